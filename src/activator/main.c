@@ -33,6 +33,7 @@
 
 typedef struct {
         Service *devices;
+        int templatefd;                 /* Mount namespace with the prepared service root. */
 
         int fd_signal;
         int fd_ep;
@@ -42,6 +43,7 @@ typedef struct {
 static Manager *manager_free(Manager *m) {
         c_close(m->fd_ep);
         c_close(m->fd_signal);
+        c_close(m->templatefd);
         service_free(m->devices);
         free(m);
         return NULL;
@@ -59,10 +61,16 @@ static int manager_new(Manager **manager) {
         if (!m)
                 return -ENOMEM;
 
+        m->templatefd = -1;
+
         r = service_new("org.bus1.devices", &m->devices);
         if (r < 0)
                 return r;
 
+        r = service_template_new(&m->templatefd);
+        if (r < 0)
+                kmsg(LOG_WARNING, "Failed to prepare the service root template: %s.", strerror(-r));
+
         sigemptyset(&mask);
         sigaddset(&mask, SIGTERM);
         sigaddset(&mask, SIGINT);
@@ -102,7 +110,7 @@ static int manager_start_services(Manager *m, pid_t died_pid) {
                 return -EIO;
 
         if (m->devices->pid < 0) {
-                r = service_activate(m->devices);
+                r = service_activate(m->devices, m->templatefd);
                 if (r < 0)
                         return r;
         }
@@ -18,6 +18,7 @@
 #include <c-macro.h>
 #include <c-syscall.h>
 #include <linux/sched.h>
+#include <sched.h>
 #include <sys/mount.h>
 #include <sys/prctl.h>
 #include <sys/stat.h>
@@ -78,8 +79,8 @@ int service_terminate(Service *s) {
         return 0;
 }
 
-int service_activate(Service *s) {
-        pid_t p;
+/* The skeleton of a service root at /tmp, the same for all services. */
+static int service_root_new(void) {
         static const char *mounts[] = {
                 "/dev",
                 "/etc",
@@ -87,8 +88,98 @@ int service_activate(Service *s) {
                 "/sys",
                 "/usr",
         };
+        int r;
+
+        r = tmpfs_root("/tmp");
+        if (r < 0)
+                return r;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(mounts); i++) {
+                _c_cleanup_(c_freep) char *target = NULL;
+
+                if (asprintf(&target, "/tmp%s", mounts[i]) < 0)
+                        return -ENOMEM;
+
+                if (mount(mounts[i], target, NULL, MS_BIND|MS_REC, NULL) < 0)
+                        return -errno;
+        }
+
+        return 0;
+}
+
+/* Build the service root once in a mount namespace of its own, which is kept
+ * alive by the returned fd. Every service gets a copy of it. */
+int service_template_new(int *templatefdp) {
+        _c_cleanup_(c_closep) int nsfd = -1;
+        _c_cleanup_(c_closep) int templatefd = -1;
+        int r;
+
+        nsfd = open("/proc/self/ns/mnt", O_RDONLY|O_CLOEXEC);
+        if (nsfd < 0)
+                return -errno;
+
+        if (unshare(CLONE_NEWNS) < 0)
+                return -errno;
+
+        r = service_root_new();
+
+        /* The tmpfs is shared between the copies, the services only write
+         * to their own mounts on top of it. */
+        if (r >= 0 && mount(NULL, "/tmp", NULL, MS_BIND|MS_REMOUNT|MS_RDONLY|MS_NOSUID|MS_NODEV|MS_NOEXEC, NULL) < 0)
+                r = -errno;
+
+        if (r >= 0) {
+                templatefd = open("/proc/self/ns/mnt", O_RDONLY|O_CLOEXEC);
+                if (templatefd < 0)
+                        r = -errno;
+        }
+
+        if (setns(nsfd, CLONE_NEWNS) < 0)
+                return -errno;
+
+        if (r < 0)
+                return r;
+
+        *templatefdp = templatefd;
+        templatefd = -1;
+
+        return 0;
+}
+
+/* Enter a private copy of the template, or build the root from scratch if
+ * there is none. */
+static int service_root_enter(Service *s, int templatefd) {
+        if (templatefd >= 0) {
+                if (setns(templatefd, CLONE_NEWNS) >= 0) {
+                        /* Never modify the template itself. */
+                        if (unshare(CLONE_NEWNS) < 0)
+                                return -errno;
+
+                        return 0;
+                }
+
+                kmsg(LOG_WARNING, "Failed to enter the root template for service %s: %m.", s->name);
+        }
+
+        if (unshare(CLONE_NEWNS) < 0)
+                return -errno;
+
+        return service_root_new();
+}
+
+int service_activate(Service *s, int templatefd) {
+        pid_t p;
+        static const struct {
+                const char *target;
+                const char *options;
+        } tmpfs[] = {
+                { "/tmp/run", "mode=0755,size=4M" },
+                { "/tmp/tmp", "mode=01777,size=1M" },
+        };
         _c_cleanup_(c_freep) char *datadir = NULL;
         _c_cleanup_(c_freep) char *tmplink = NULL;
+        _c_cleanup_(c_freep) char *rundir = NULL;
+        _c_cleanup_(c_freep) char *runtarget = NULL;
         int r;
 
         assert(s->pid < 0);
@@ -121,7 +212,21 @@ int service_activate(Service *s) {
         if (chmod(datadir, 0770) < 0)
                 return -errno;
 
-        p = c_syscall_clone(SIGCHLD|CLONE_NEWNS|CLONE_NEWIPC, NULL);
+        /* The runtime directory is shared with the host, it is where the
+         * service publishes files and sockets for its clients. */
+        if (asprintf(&rundir, "/run/%s", s->name) < 0)
+                return -ENOMEM;
+
+        if (mkdir(rundir, 0755) < 0 && errno != EEXIST)
+                return -errno;
+
+        if (chown(rundir, s->identity, s->identity) < 0)
+                return -errno;
+
+        if (asprintf(&runtarget, "/tmp/run/%s", s->name) < 0)
+                return -ENOMEM;
+
+        p = c_syscall_clone(SIGCHLD|CLONE_NEWIPC, NULL);
         if (p < 0)
                 return -errno;
 
@@ -136,24 +241,28 @@ int service_activate(Service *s) {
         if (setsid() < 0)
                 return -errno;
 
-        r = tmpfs_root("/tmp");
+        r = service_root_enter(s, templatefd);
         if (r < 0)
                 return r;
 
-        for (size_t i = 0; i < C_ARRAY_SIZE(mounts); i++) {
-                _c_cleanup_(c_freep) char *target = NULL;
+        for (size_t i = 0; i < C_ARRAY_SIZE(tmpfs); i++)
+                if (mount("tmpfs", tmpfs[i].target, "tmpfs", MS_NOSUID|MS_NOEXEC|MS_NODEV|MS_STRICTATIME, tmpfs[i].options) < 0)
+                        return -errno;
 
-                if (asprintf(&target, "/tmp%s", mounts[i]) < 0)
-                        return -ENOMEM;
+        if (mkdir(runtarget, 0755) < 0)
+                return -errno;
 
-                if (mount(mounts[i], target, NULL, MS_BIND|MS_REC, NULL) < 0)
-                        return -errno;
-        }
+        if (mount(rundir, runtarget, NULL, MS_BIND, NULL) < 0)
+                return -errno;
+
+        if (mount(NULL, runtarget, NULL, MS_BIND|MS_NOSUID|MS_NODEV|MS_NOEXEC|MS_REMOUNT, NULL) < 0)
+                return -errno;
 
         if (mount(datadir, "/tmp/var", NULL, MS_BIND, NULL) < 0)
                 return -errno;
 
-        if (mount(NULL, "/tmp/var", NULL, MS_BIND|MS_RDONLY|MS_REMOUNT, NULL) < 0)
+        /* The data directory keeps the state of the service across boots. */
+        if (mount(NULL, "/tmp/var", NULL, MS_BIND|MS_NOSUID|MS_NODEV|MS_NOEXEC|MS_REMOUNT, NULL) < 0)
                 return -errno;
 
         if (chdir("/tmp") < 0)
@@ -32,5 +32,6 @@ int service_new(const char *name, Service **servicep);
 Service *service_free(Service *s);
 C_DEFINE_CLEANUP(Service *, service_free);
 
-int service_activate(Service *s);
+int service_template_new(int *templatefdp);
+int service_activate(Service *s, int templatefd);
 int service_terminate(Service *s);
@@ -0,0 +1,195 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+/* Small objects which live as long as the device tree: device nodes,
+ * devices, subsystems, devtypes and slots. Every size class hands out
+ * objects from its own chunks, freed objects are kept on a per-class
+ * freelist and reused; chunks are only returned in arena_free(). This
+ * keeps the objects of a kind close to each other and the heap of a
+ * long-running daemon unfragmented. Only used from the main thread. */
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+static const size_t arena_sizes[] = { 16, 32, 48, 64, 96, 128, 160, 192, 256, 384, 512 };
+
+#define ARENA_CLASSES C_ARRAY_SIZE(arena_sizes)
+
+struct arena_object {
+        struct arena_object *next;
+};
+
+struct arena_chunk {
+        struct arena_chunk *next;
+        max_align_t data[];
+};
+
+struct arena_class {
+        struct arena_object *free;
+        struct arena_chunk *chunks;
+        char *unused;                   /* Never handed out in the newest chunk. */
+        char *end;
+
+        uint64_t n_gets;
+        uint64_t n_puts;
+        size_t n_objects;
+        size_t n_chunks;
+};
+
+struct Arena {
+        struct arena_class classes[ARENA_CLASSES];
+        uint64_t n_large;               /* Larger than any class, from malloc(). */
+};
+
+Arena *arena_free(Arena *arena) {
+        if (!arena)
+                return NULL;
+
+        for (size_t i = 0; i < ARENA_CLASSES; i++) {
+                while (arena->classes[i].chunks) {
+                        struct arena_chunk *chunk = arena->classes[i].chunks;
+
+                        arena->classes[i].chunks = chunk->next;
+                        munmap(chunk, ARENA_CHUNK_SIZE);
+                }
+        }
+
+        free(arena);
+
+        return NULL;
+}
+
+int arena_new(Arena **arenap) {
+        Arena *arena;
+
+        arena = calloc(1, sizeof(Arena));
+        if (!arena)
+                return -ENOMEM;
+
+        *arenap = arena;
+
+        return 0;
+}
+
+static struct arena_class *arena_class(Arena *arena, size_t size, size_t *indexp) {
+        for (size_t i = 0; i < ARENA_CLASSES; i++) {
+                if (size <= arena_sizes[i]) {
+                        *indexp = i;
+                        return &arena->classes[i];
+                }
+        }
+
+        return NULL;
+}
+
+static int arena_class_grow(struct arena_class *class) {
+        struct arena_chunk *chunk;
+
+        chunk = mmap(NULL, ARENA_CHUNK_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+                return -ENOMEM;
+
+        chunk->next = class->chunks;
+        class->chunks = chunk;
+        class->n_chunks++;
+
+        class->unused = (char *)chunk->data;
+        class->end = (char *)chunk + ARENA_CHUNK_SIZE;
+
+        return 0;
+}
+
+/* Returns uninitialized memory for an object of the given size, or NULL if
+ * we are out of memory. */
+void *arena_get(Arena *arena, size_t size) {
+        struct arena_class *class;
+        struct arena_object *object;
+        size_t i;
+
+        class = arena_class(arena, size, &i);
+        if (!class) {
+                arena->n_large++;
+                return malloc(size);
+        }
+
+        if (class->free) {
+                object = class->free;
+                class->free = object->next;
+        } else {
+                if (!class->unused || class->end - class->unused < (ptrdiff_t)arena_sizes[i])
+                        if (arena_class_grow(class) < 0)
+                                return NULL;
+
+                object = (struct arena_object *)class->unused;
+                class->unused += arena_sizes[i];
+        }
+
+        class->n_gets++;
+        class->n_objects++;
+
+        return object;
+}
+
+/* The size must be the same as passed to arena_get(). */
+void arena_put(Arena *arena, void *p, size_t size) {
+        struct arena_class *class;
+        struct arena_object *object = p;
+        size_t i;
+
+        if (!p)
+                return;
+
+        class = arena_class(arena, size, &i);
+        if (!class) {
+                arena->n_large--;
+                free(p);
+                return;
+        }
+
+        object->next = class->free;
+        class->free = object;
+
+        class->n_puts++;
+        class->n_objects--;
+}
+
+void arena_write_stats(Arena *arena, FILE *f) {
+        size_t n_bytes = 0, n_used = 0;
+
+        for (size_t i = 0; i < ARENA_CLASSES; i++) {
+                struct arena_class *class = &arena->classes[i];
+
+                if (class->n_chunks == 0)
+                        continue;
+
+                fprintf(f, "arena_class_%zu_objects %zu\n", arena_sizes[i], class->n_objects);
+                fprintf(f, "arena_class_%zu_chunks %zu\n", arena_sizes[i], class->n_chunks);
+                fprintf(f, "arena_class_%zu_gets %" PRIu64 "\n", arena_sizes[i], class->n_gets);
+                fprintf(f, "arena_class_%zu_puts %" PRIu64 "\n", arena_sizes[i], class->n_puts);
+
+                n_bytes += class->n_chunks * ARENA_CHUNK_SIZE;
+                n_used += class->n_objects * arena_sizes[i];
+        }
+
+        fprintf(f, "arena_bytes %zu\n", n_bytes);
+        fprintf(f, "arena_bytes_used %zu\n", n_used);
+        fprintf(f, "arena_large_objects %" PRIu64 "\n", arena->n_large);
+}
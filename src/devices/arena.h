@@ -0,0 +1,31 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <stdio.h>
+
+typedef struct Arena Arena;
+
+Arena *arena_free(Arena *arena);
+int arena_new(Arena **arenap);
+
+void *arena_get(Arena *arena, size_t size);
+void arena_put(Arena *arena, void *p, size_t size);
+
+void arena_write_stats(Arena *arena, FILE *f);
+
+C_DEFINE_CLEANUP(Arena *, arena_free);
@@ -0,0 +1,607 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* Feed generated or recorded uevents through device_from_nulstr() and the
+ * device tree of a Manager over a synthetic sysfs directory:
+ *   bench-uevent [--devices N] [--depth N] [--rounds N]
+ *   bench-uevent --record FILE [--count N]
+ *   bench-uevent --replay FILE [--rounds N]
+ *   bench-uevent --parse [--replay FILE] [--devices N] [--rounds N]
+ * A replay file is a list of uevent payloads, every one prefixed by its
+ * size as uint32_t. Allocations are counted by wrapping malloc(),
+ * calloc() and realloc() at link time; the wrapping only sees the calls
+ * of our own objects, "allocs/event" leaves out the allocations inside
+ * libc, like strdup(), asprintf() or getline(). */
+
+#include <c-macro.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "device.h"
+#include "manager.h"
+#include "uevent.h"
+#include "uevent-parse.h"
+
+struct bench_events {
+        char *data;
+        size_t n_data;
+        size_t *offsets;
+        size_t n_events;
+};
+
+static uint64_t n_allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size) {
+        n_allocs++;
+        return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+        n_allocs++;
+        return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+        n_allocs++;
+        return __real_realloc(p, size);
+}
+
+static uint64_t bench_now_nsec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_events_clear(struct bench_events *events) {
+        free(events->data);
+        free(events->offsets);
+        *events = (struct bench_events){};
+}
+
+static int bench_events_add(struct bench_events *events, const char *payload, size_t n_payload) {
+        size_t *offsets;
+        char *data;
+
+        data = realloc(events->data, events->n_data + n_payload);
+        if (!data)
+                return -ENOMEM;
+        events->data = data;
+
+        offsets = realloc(events->offsets, (events->n_events + 2) * sizeof(size_t));
+        if (!offsets)
+                return -ENOMEM;
+        events->offsets = offsets;
+
+        memcpy(events->data + events->n_data, payload, n_payload);
+        events->offsets[events->n_events++] = events->n_data;
+        events->n_data += n_payload;
+        events->offsets[events->n_events] = events->n_data;
+
+        return 0;
+}
+
+/* Properties in the order the kernel sends them, SEQNUM is last. */
+static int bench_events_addf(struct bench_events *events, uint64_t *seqnum,
+                             const char *action, const char *devpath, const char *devpath_old,
+                             const char *subsystem, const char *devname, const char *modalias) {
+        char buf[UEVENT_BUFFER_SIZE];
+        size_t n = 0;
+
+        n += snprintf(buf + n, sizeof(buf) - n, "ACTION=%s", action) + 1;
+        n += snprintf(buf + n, sizeof(buf) - n, "DEVPATH=%s", devpath) + 1;
+        n += snprintf(buf + n, sizeof(buf) - n, "SUBSYSTEM=%s", subsystem) + 1;
+        if (devpath_old)
+                n += snprintf(buf + n, sizeof(buf) - n, "DEVPATH_OLD=%s", devpath_old) + 1;
+        if (devname)
+                n += snprintf(buf + n, sizeof(buf) - n, "DEVNAME=%s", devname) + 1;
+        if (modalias)
+                n += snprintf(buf + n, sizeof(buf) - n, "MODALIAS=%s", modalias) + 1;
+        n += snprintf(buf + n, sizeof(buf) - n, "SEQNUM=%" PRIu64, ++*seqnum) + 1;
+
+        if (n > sizeof(buf))
+                return -ENOBUFS;
+
+        return bench_events_add(events, buf, n);
+}
+
+/* A tree of depth levels, every device has its index in the path. */
+static void bench_devpath(char *devpath, size_t n_devpath, size_t i, unsigned int depth, const char *leaf) {
+        size_t k = i;
+        size_t n;
+
+        n = snprintf(devpath, n_devpath, "/devices/pci0000:%02zx", k % 4);
+        for (unsigned int d = 1; d < depth && n < n_devpath; d++) {
+                k /= 4;
+                n += snprintf(devpath + n, n_devpath - n, "/port%zu", k % 4);
+        }
+        if (n < n_devpath)
+                snprintf(devpath + n, n_devpath - n, "/%s%zu", leaf, i);
+}
+
+static int bench_generate(struct bench_events *add, struct bench_events *move, struct bench_events *remove,
+                          size_t n_devices, unsigned int depth) {
+        static const char *subsystems[] = { "pci", "usb", "block", "input" };
+        uint64_t seqnum = 0;
+        char devpath[1024], devpath_old[1024], devname[64], modalias[128];
+        int r;
+
+        for (size_t i = 0; i < n_devices; i++) {
+                bench_devpath(devpath, sizeof(devpath), i, depth, "dev");
+                snprintf(devname, sizeof(devname), "bench/%zu", i);
+                snprintf(modalias, sizeof(modalias), "pci:v%08zXd%08zXsv*sd*bc%02zXsc00i00", i % 64, i % 1024, i % 16);
+
+                r = bench_events_addf(add, &seqnum, "add", devpath, NULL, subsystems[i % C_ARRAY_SIZE(subsystems)],
+                                      devname, modalias);
+                if (r < 0)
+                        return r;
+        }
+
+        for (size_t i = 0; i < n_devices; i++) {
+                bench_devpath(devpath_old, sizeof(devpath_old), i, depth, "dev");
+                bench_devpath(devpath, sizeof(devpath), i, depth, "moved");
+
+                r = bench_events_addf(move, &seqnum, "move", devpath, devpath_old,
+                                      subsystems[i % C_ARRAY_SIZE(subsystems)], NULL, NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        for (size_t i = 0; i < n_devices; i++) {
+                bench_devpath(devpath, sizeof(devpath), i, depth, "moved");
+
+                r = bench_events_addf(remove, &seqnum, "remove", devpath, NULL,
+                                      subsystems[i % C_ARRAY_SIZE(subsystems)], NULL, NULL);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int bench_sysfs_new(char *dir, int *sysfdp) {
+        static const char *dirs[] = { "bus", "class", "devices", "kernel" };
+        _c_cleanup_(c_closep) int sysfd = -1;
+        _c_cleanup_(c_closep) int fd = -1;
+
+        if (!mkdtemp(dir))
+                return -errno;
+
+        sysfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (sysfd < 0)
+                return -errno;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(dirs); i++)
+                if (mkdirat(sysfd, dirs[i], 0755) < 0)
+                        return -errno;
+
+        fd = openat(sysfd, "kernel/uevent_seqnum", O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+        if (fd < 0)
+                return -errno;
+
+        if (write(fd, "0\n", 2) != 2)
+                return -EIO;
+
+        *sysfdp = sysfd;
+        sysfd = -1;
+
+        return 0;
+}
+
+/* Create the bus directories of all subsystems the events refer to. */
+static int bench_sysfs_add_subsystems(int sysfd, struct bench_events *events) {
+        for (size_t i = 0; i < events->n_events; i++) {
+                const char *s = events->data + events->offsets[i];
+                const char *e = events->data + events->offsets[i + 1];
+
+                for (; s < e; s += strlen(s) + 1) {
+                        char path[256];
+
+                        if (strncmp(s, "SUBSYSTEM=", strlen("SUBSYSTEM=")) != 0)
+                                continue;
+
+                        snprintf(path, sizeof(path), "bus/%s", s + strlen("SUBSYSTEM="));
+                        if (!strchr(s + strlen("SUBSYSTEM="), '/') &&
+                            mkdirat(sysfd, path, 0755) < 0 && errno != EEXIST)
+                                return -errno;
+                }
+        }
+
+        return 0;
+}
+
+static void bench_sysfs_free(const char *dir, int sysfd) {
+        static const char *dirs[] = { "bus", "class", "devices", "kernel" };
+
+        unlinkat(sysfd, "kernel/uevent_seqnum", 0);
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(dirs); i++) {
+                _c_cleanup_(c_closedirp) DIR *d = NULL;
+                int fd;
+
+                fd = openat(sysfd, dirs[i], O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+                if (fd < 0)
+                        continue;
+
+                d = fdopendir(fd);
+                if (!d) {
+                        c_close(fd);
+                        continue;
+                }
+
+                for (struct dirent *de = readdir(d); de; de = readdir(d))
+                        if (de->d_name[0] != '.')
+                                unlinkat(dirfd(d), de->d_name, AT_REMOVEDIR);
+
+                unlinkat(sysfd, dirs[i], AT_REMOVEDIR);
+        }
+
+        rmdir(dir);
+}
+
+static int bench_compare(const void *a, const void *b) {
+        uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+static int bench_run(Manager *m, const char *name, struct bench_events *events) {
+        _c_cleanup_(c_freep) uint64_t *nsecs = NULL;
+        char buf[UEVENT_BUFFER_SIZE];
+        uint64_t begin_nsec, total_nsec = 0, allocs;
+        size_t n_failed = 0;
+
+        if (events->n_events == 0)
+                return 0;
+
+        nsecs = calloc(events->n_events, sizeof(uint64_t));
+        if (!nsecs)
+                return -ENOMEM;
+
+        allocs = n_allocs;
+
+        for (size_t i = 0; i < events->n_events; i++) {
+                size_t n = events->offsets[i + 1] - events->offsets[i];
+                struct device *device;
+                uint64_t seqnum;
+                int action, r;
+
+                if (n > sizeof(buf))
+                        continue;
+
+                memcpy(buf, events->data + events->offsets[i], n);
+
+                begin_nsec = bench_now_nsec();
+                r = device_from_nulstr(m, &device, &action, &seqnum, buf, n);
+                nsecs[i] = bench_now_nsec() - begin_nsec;
+                total_nsec += nsecs[i];
+
+                if (r < 0)
+                        n_failed++;
+        }
+
+        allocs = n_allocs - allocs;
+        qsort(nsecs, events->n_events, sizeof(uint64_t), bench_compare);
+
+        printf("%-8s %9zu events %9.0f events/s %6.2f allocs/event  p50 %6" PRIu64 " ns  p99 %6" PRIu64 " ns  max %8" PRIu64 " ns  %zu failed\n",
+               name, events->n_events,
+               total_nsec > 0 ? events->n_events * 1e9 / total_nsec : 0.0,
+               (double)allocs / events->n_events,
+               nsecs[events->n_events / 2],
+               nsecs[events->n_events * 99 / 100],
+               nsecs[events->n_events - 1],
+               n_failed);
+
+        return 0;
+}
+
+/* Only the tokenizer, on a fresh copy of all events for every pass. */
+static int bench_parse(const char *name, struct bench_events *events, unsigned int n_passes) {
+        _c_cleanup_(c_freep) char *data = NULL;
+        uint64_t begin_nsec, total_nsec = 0;
+        size_t n_fields = 0, n_failed = 0;
+
+        if (events->n_events == 0 || n_passes == 0)
+                return 0;
+
+        data = malloc(events->n_data);
+        if (!data)
+                return -ENOMEM;
+
+        for (unsigned int i = 0; i < n_passes; i++) {
+                memcpy(data, events->data, events->n_data);
+
+                begin_nsec = bench_now_nsec();
+                for (size_t k = 0; k < events->n_events; k++) {
+                        struct uevent_fields fields;
+
+                        if (uevent_parse(data + events->offsets[k],
+                                         events->offsets[k + 1] - events->offsets[k],
+                                         '\0', &fields) < 0) {
+                                n_failed++;
+                                continue;
+                        }
+
+                        for (size_t f = 0; f < _UEVENT_FIELD_N; f++)
+                                n_fields += !!fields.values[f];
+                }
+                total_nsec += bench_now_nsec() - begin_nsec;
+        }
+
+        printf("%-8s %9zu events %9.0f events/s %6.1f ns/event %8.1f MB/s  %4.1f fields/event  %zu failed\n",
+               name, events->n_events,
+               total_nsec > 0 ? (double)events->n_events * n_passes * 1e9 / total_nsec : 0.0,
+               (double)total_nsec / ((double)events->n_events * n_passes),
+               total_nsec > 0 ? (double)events->n_data * n_passes * 1e3 / total_nsec : 0.0,
+               (double)n_fields / ((double)events->n_events * n_passes),
+               n_failed / n_passes);
+
+        return 0;
+}
+
+static volatile sig_atomic_t bench_stop;
+
+static void bench_signal(int sig) {
+        bench_stop = 1;
+}
+
+static int bench_record(const char *file, size_t n_max) {
+        struct sigaction sa = {
+                .sa_handler = bench_signal,
+        };
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        _c_cleanup_(c_closep) int fd = -1;
+        char buf[UEVENT_BUFFER_SIZE];
+        size_t n_events = 0;
+
+        fd = uevent_connect();
+        if (fd < 0)
+                return fd;
+
+        f = fopen(file, "we");
+        if (!f)
+                return -errno;
+
+        /* Without SA_RESTART, to interrupt recv(). */
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        while (!bench_stop && (n_max == 0 || n_events < n_max)) {
+                ssize_t len;
+                char *payload;
+                uint32_t size;
+
+                len = recv(fd, buf, sizeof(buf), 0);
+                if (len < 0) {
+                        if (errno == EINTR || errno == EAGAIN)
+                                continue;
+
+                        return -errno;
+                }
+
+                if (len == 0 || buf[len - 1] != '\0')
+                        continue;
+
+                /* Skip the "action@devpath" header. */
+                payload = memchr(buf, '\0', len);
+                if (!payload || ++payload >= buf + len)
+                        continue;
+
+                size = buf + len - payload;
+                if (fwrite(&size, sizeof(size), 1, f) != 1 ||
+                    fwrite(payload, size, 1, f) != 1)
+                        return -EIO;
+
+                n_events++;
+        }
+
+        if (fflush(f) != 0)
+                return -errno;
+
+        fprintf(stderr, "Recorded %zu uevents.\n", n_events);
+
+        return 0;
+}
+
+static int bench_load(struct bench_events *events, const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        char buf[UEVENT_BUFFER_SIZE];
+        uint32_t size;
+        int r;
+
+        f = fopen(file, "re");
+        if (!f)
+                return -errno;
+
+        while (fread(&size, sizeof(size), 1, f) == 1) {
+                if (size == 0 || size > sizeof(buf))
+                        return -EINVAL;
+
+                if (fread(buf, size, 1, f) != 1)
+                        return -EIO;
+
+                if (buf[size - 1] != '\0')
+                        return -EINVAL;
+
+                r = bench_events_add(events, buf, size);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static int bench(const char *replay, bool parse, size_t n_devices, unsigned int depth, unsigned int n_rounds) {
+        struct bench_events add = {}, move = {}, remove = {};
+        char dir[] = "/tmp/bench-uevent.XXXXXX";
+        int sysfd = -1;
+        int r;
+
+        if (replay)
+                r = bench_load(&add, replay);
+        else
+                r = bench_generate(&add, &move, &remove, n_devices, depth);
+        if (r < 0)
+                goto finish;
+
+        if (parse) {
+                /* Enough passes to make the timer resolution irrelevant. */
+                r = bench_parse(replay ? "replay" : "add", &add, n_rounds * 100);
+                if (r < 0)
+                        goto finish;
+
+                r = bench_parse("move", &move, n_rounds * 100);
+                if (r < 0)
+                        goto finish;
+
+                r = bench_parse("remove", &remove, n_rounds * 100);
+                goto finish;
+        }
+
+        r = bench_sysfs_new(dir, &sysfd);
+        if (r < 0)
+                goto finish;
+
+        r = bench_sysfs_add_subsystems(sysfd, &add);
+        if (r < 0)
+                goto finish;
+
+        /* Every round starts with an empty tree. */
+        for (unsigned int i = 0; i < n_rounds; i++) {
+                _c_cleanup_(manager_freep) Manager *m = NULL;
+
+                r = manager_new_at(&m, sysfd);
+                if (r < 0)
+                        goto finish;
+
+                printf("Round %u:\n", i + 1);
+
+                r = bench_run(m, replay ? "replay" : "add", &add);
+                if (r < 0)
+                        goto finish;
+
+                r = bench_run(m, "move", &move);
+                if (r < 0)
+                        goto finish;
+
+                r = bench_run(m, "remove", &remove);
+                if (r < 0)
+                        goto finish;
+        }
+
+finish:
+        if (sysfd >= 0) {
+                bench_sysfs_free(dir, sysfd);
+                c_close(sysfd);
+        }
+
+        bench_events_clear(&add);
+        bench_events_clear(&move);
+        bench_events_clear(&remove);
+
+        return r;
+}
+
+int main(int argc, char **argv) {
+        static const struct option options[] = {
+                { "help",    no_argument,       NULL, 'h' },
+                { "devices", required_argument, NULL, 'n' },
+                { "depth",   required_argument, NULL, 'd' },
+                { "rounds",  required_argument, NULL, 'r' },
+                { "record",  required_argument, NULL, 'R' },
+                { "replay",  required_argument, NULL, 'P' },
+                { "count",   required_argument, NULL, 'c' },
+                { "parse",   no_argument,       NULL, 'p' },
+                {}
+        };
+        const char *record = NULL;
+        const char *replay = NULL;
+        bool parse = false;
+        size_t n_devices = 10000;
+        size_t n_count = 0;
+        unsigned int depth = 8;
+        unsigned int n_rounds = 3;
+        int c, r;
+
+        while ((c = getopt_long(argc, argv, "hn:d:r:R:P:c:p", options, NULL)) >= 0) {
+                switch (c) {
+                case 'h':
+                        fprintf(stderr, "Usage: %s [--devices N] [--depth N] [--rounds N]\n"
+                                        "       %s --record FILE [--count N]\n"
+                                        "       %s --replay FILE [--rounds N]\n"
+                                        "       %s --parse [--replay FILE] [--devices N] [--rounds N]\n"
+                                        "allocs/event counts malloc(), calloc() and realloc() calls, not\n"
+                                        "the allocations inside libc, like strdup() or asprintf().\n",
+                                program_invocation_short_name, program_invocation_short_name,
+                                program_invocation_short_name, program_invocation_short_name);
+                        return EXIT_SUCCESS;
+
+                case 'n':
+                        n_devices = strtoul(optarg, NULL, 10);
+                        break;
+
+                case 'd':
+                        depth = c_max(strtoul(optarg, NULL, 10), 1UL);
+                        break;
+
+                case 'r':
+                        n_rounds = strtoul(optarg, NULL, 10);
+                        break;
+
+                case 'R':
+                        record = optarg;
+                        break;
+
+                case 'P':
+                        replay = optarg;
+                        break;
+
+                case 'c':
+                        n_count = strtoul(optarg, NULL, 10);
+                        break;
+
+                case 'p':
+                        parse = true;
+                        break;
+
+                default:
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (record)
+                r = bench_record(record, n_count);
+        else
+                r = bench(replay, parse, n_devices, depth, n_rounds);
+        if (r < 0) {
+                fprintf(stderr, "Error: %s\n", strerror(-r));
+                return EXIT_FAILURE;
+        }
+
+        return EXIT_SUCCESS;
+}
@@ -19,8 +19,11 @@
 #include <c-rbtree.h>
 #include <string.h>
 #include "device.h"
+#include "monitor.h"
+#include "permissions.h"
 #include "shared/kmsg.h"
 #include "uevent.h"
+#include "uevent-parse.h"
 
 static struct devtype *devtype_free(struct devtype *devtype) {
         if (!devtype)
@@ -28,7 +31,10 @@ static struct devtype *devtype_free(struct devtype *devtype) {
 
         assert(!c_list_first(&devtype->devices));
 
-        free(devtype);
+        permissions_devtype_free(devtype->permissions);
+
+        intern_put(devtype->subsystem->manager->properties, devtype->name);
+        arena_put(devtype->subsystem->manager->arena, devtype, sizeof(*devtype));
 
         return NULL;
 }
@@ -39,22 +45,24 @@ static void devtype_freep(struct devtype **devtypep) {
 
 static int devtype_new(struct subsystem *subsystem, struct devtype **devtypep, const char *name) {
         _c_cleanup_(devtype_freep) struct devtype *devtype = NULL;
-        size_t n_name;
 
         assert(subsystem);
         assert(devtypep);
 
-        n_name = name ? strlen(name) + 1 : 0;
-        devtype = malloc(sizeof(*devtype) + n_name);
+        devtype = arena_get(subsystem->manager->arena, sizeof(*devtype));
         if (!devtype)
                 return -ENOMEM;
         devtype->subsystem = subsystem;
+        devtype->name = NULL;
+        devtype->permissions = NULL;
         c_rbnode_init(&devtype->rb);
         c_list_init(&devtype->devices);
-        if (name)
-                devtype->name = memcpy((void*)(devtype + 1), name, n_name);
-        else
-                devtype->name = NULL;
+
+        if (name) {
+                devtype->name = intern_get(subsystem->manager->properties, name, strlen(name));
+                if (!devtype->name)
+                        return -ENOMEM;
+        }
 
         *devtypep = devtype;
         devtype = NULL;
@@ -119,7 +127,8 @@ struct subsystem *subsystem_free(struct subsystem *subsystem) {
                 devtype_free(devtype);
         }
 
-        free(subsystem);
+        intern_put(subsystem->manager->properties, subsystem->name);
+        arena_put(subsystem->manager->arena, subsystem, sizeof(*subsystem));
 
         return NULL;
 }
@@ -146,7 +155,6 @@ static int device_subsystem_is_valid(Manager *m, const char *name) {
 
 static int subsystem_new(Manager *manager, struct subsystem **subsystemp, const char *name) {
         _c_cleanup_(subsystem_freep) struct subsystem *subsystem = NULL;
-        size_t n_name;
         int r;
 
         assert(subsystemp);
@@ -156,14 +164,17 @@ static int subsystem_new(Manager *manager, struct subsystem **subsystemp, const
         if (r < 0)
                 return r;
 
-        n_name = strlen(name) + 1;
-        subsystem = malloc(sizeof(*subsystem) + n_name);
+        subsystem = arena_get(manager->arena, sizeof(*subsystem));
         if (!subsystem)
                 return -ENOMEM;
         subsystem->manager = manager;
+        subsystem->n_uevents = 0;
         c_rbnode_init(&subsystem->rb);
         subsystem->devtypes = (CRBTree){};
-        subsystem->name = memcpy((void*)(subsystem + 1), name, n_name);
+
+        subsystem->name = intern_get(manager->properties, name, strlen(name));
+        if (!subsystem->name)
+                return -ENOMEM;
 
         *subsystemp = subsystem;
         subsystem = NULL;
@@ -177,6 +188,14 @@ static int subsystems_compare(CRBTree *t, void *k, CRBNode *n) {
         return strcmp(name, subsystem->name);
 }
 
+struct subsystem *subsystem_get(Manager *m, const char *name) {
+        CRBNode *n;
+
+        n = c_rbtree_find_node(&m->subsystems, subsystems_compare, name);
+
+        return n ? c_container_of(n, struct subsystem, rb) : NULL;
+}
+
 int subsystem_add(Manager *m, struct subsystem **subsystemp, const char *name) {
         struct subsystem *subsystem;
         CRBNode **slot, *p;
@@ -207,71 +226,243 @@ int subsystem_add(Manager *m, struct subsystem **subsystemp, const char *name) {
         return 0;
 }
 
-static int devices_compare(CRBTree *t, void *k, CRBNode *n) {
-        struct device *device = c_container_of(n, struct device, rb);
-        const char *devpath = k;
+struct component {
+        const char *name;
+        size_t n_name;
+};
+
+static int device_nodes_compare(CRBTree *t, void *k, CRBNode *n) {
+        struct device_node *node = c_container_of(n, struct device_node, rb);
+        struct component *component = k;
+        int r;
+
+        r = strncmp(component->name, node->name, component->n_name);
+        if (r != 0)
+                return r;
+
+        return node->name[component->n_name] == '\0' ? 0 : -1;
+}
+
+/* Split off the next component of a devpath, returns false at the end. */
+static bool component_next(const char **devpathp, struct component *component) {
+        const char *devpath = *devpathp;
+
+        while (*devpath == '/')
+                devpath++;
+
+        if (*devpath == '\0')
+                return false;
+
+        component->name = devpath;
+        component->n_name = strcspn(devpath, "/");
+        *devpathp = devpath + component->n_name;
+
+        return true;
+}
+
+static CRBTree *device_node_siblings(Manager *m, struct device_node *node) {
+        return node->parent ? &node->parent->children : &m->devices;
+}
+
+static struct device_node *device_node_from_rb(CRBNode *n) {
+        return n ? c_container_of(n, struct device_node, rb) : NULL;
+}
+
+/* Release the node and all its parents which are not needed anymore. */
+static void device_node_release(Manager *m, struct device_node *node) {
+        while (node && !node->device && !c_rbtree_first(&node->children)) {
+                struct device_node *parent = node->parent;
+
+                c_rbtree_remove(device_node_siblings(m, node), &node->rb);
+                intern_put(m->components, node->name);
+                arena_put(m->arena, node, sizeof(*node));
+
+                node = parent;
+        }
+}
+
+static struct device_node *device_node_lookup(Manager *m, const char *devpath) {
+        struct device_node *node = NULL;
+        struct component component;
+
+        while (component_next(&devpath, &component)) {
+                node = device_node_from_rb(c_rbtree_find_node(node ? &node->children : &m->devices,
+                                                              device_nodes_compare, &component));
+                if (!node)
+                        return NULL;
+        }
+
+        return node;
+}
+
+static int device_node_add(Manager *m, struct device_node **nodep, const char *devpath) {
+        struct device_node *node = NULL;
+        struct component component;
+
+        while (component_next(&devpath, &component)) {
+                CRBTree *children = node ? &node->children : &m->devices;
+                struct device_node *child;
+                CRBNode **slot, *p;
+
+                slot = c_rbtree_find_slot(children, device_nodes_compare, &component, &p);
+                if (!slot) {
+                        node = device_node_from_rb(p);
+                        continue;
+                }
+
+                child = arena_get(m->arena, sizeof(*child));
+                if (!child) {
+                        device_node_release(m, node);
+                        return -ENOMEM;
+                }
+
+                *child = (struct device_node){};
+                child->name = intern_get(m->components, component.name, component.n_name);
+                if (!child->name) {
+                        arena_put(m->arena, child, sizeof(*child));
+                        device_node_release(m, node);
+                        return -ENOMEM;
+                }
+
+                child->parent = node;
+                c_rbnode_init(&child->rb);
+                c_rbtree_add(children, p, slot, &child->rb);
+                node = child;
+        }
+
+        if (!node)
+                return -EINVAL;
+
+        *nodep = node;
+
+        return 0;
+}
+
+/* Depth-first, parents before their children. */
+static struct device_node *device_node_next(struct device_node *node) {
+        CRBNode *n;
+
+        n = c_rbtree_first(&node->children);
+        if (n)
+                return device_node_from_rb(n);
+
+        for (; node; node = node->parent) {
+                n = c_rbnode_next(&node->rb);
+                if (n)
+                        return device_node_from_rb(n);
+        }
+
+        return NULL;
+}
+
+static struct device *device_from_node(struct device_node *node) {
+        while (node && !node->device)
+                node = device_node_next(node);
+
+        return node ? node->device : NULL;
+}
+
+struct device *device_first(Manager *m) {
+        return device_from_node(device_node_from_rb(c_rbtree_first(&m->devices)));
+}
+
+/* The next device can be retrieved before the current one is freed. */
+struct device *device_next(struct device *device) {
+        return device_from_node(device_node_next(device->node));
+}
+
+/* Devices of invalid subsystems are never exposed to subscribers, new
+ * devices only after their deferred side effects. */
+bool device_is_published(struct device *device) {
+        return device->devtype && !device->pending;
+}
+
+/* Reconstruct the devpath relative to /sys/devices. */
+int device_get_devpath(struct device *device, char *devpath, size_t n_devpath) {
+        size_t n = 0;
+        char *p;
 
-        return strcmp(devpath, device->devpath);
+        for (struct device_node *node = device->node; node; node = node->parent)
+                n += strlen(node->name) + 1;
+
+        if (n > n_devpath)
+                return -ENAMETOOLONG;
+
+        p = devpath + n - 1;
+        *p = '\0';
+        for (struct device_node *node = device->node; node; node = node->parent) {
+                size_t l = strlen(node->name);
+
+                p -= l;
+                memcpy(p, node->name, l);
+                if (node->parent)
+                        *--p = '/';
+        }
+
+        return 0;
 }
 
 void device_unlink(struct device *device) {
         if (!device)
                 return;
 
-        c_rbtree_remove(&device->manager->devices, &device->rb);
+        if (device->node) {
+                device->node->device = NULL;
+                device_node_release(device->manager, device->node);
+                device->node = NULL;
+        }
+
         if (device->devtype)
                 c_list_remove(&device->devtype->devices, &device->le);
-}
-
-static struct device *device_get_by_devpath(CRBTree *devices, const char *devpath) {
-        CRBNode *n;
-
-        assert(devices);
-        assert(devpath);
 
-        n = c_rbtree_find_node(devices, devices_compare, devpath);
-        if (!n)
-                return NULL;
+        /* The device went away before its side effects were run. */
+        if (device->pending) {
+                c_list_remove(&device->manager->pending_devices, &device->pending_le);
+                device->pending = false;
+                device->manager->metrics.n_coalesce_dropped++;
+        }
 
-        return c_container_of(n, struct device, rb);
+        device->manager->snapshot_dirty = true;
 }
 
-static struct device *device_get_next_by_devpath(struct device *device) {
-        CRBNode *n;
+struct device *device_get_by_devpath(Manager *m, const char *devpath) {
+        struct device_node *node;
 
-        n = c_rbnode_next(&device->rb);
-        if (!n)
+        assert(m);
+        assert(devpath);
+
+        node = device_node_lookup(m, devpath);
+        if (!node)
                 return NULL;
 
-        return c_container_of(n, struct device, rb);
+        return node->device;
 }
 
 static struct device_slot *device_slot_free(struct device_slot *slot) {
+        struct device *device;
+
         if (!slot)
                 return NULL;
 
-        c_list_remove(&slot->device->sysfd_callbacks, &slot->le);
+        device = slot->device;
+
+        c_list_remove(&device->sysfd_callbacks, &slot->le);
 
-        if (!c_list_first(&slot->device->sysfd_callbacks)) {
-                uevent_subscription_unlink(&slot->device->manager->uevent_subscriptions, &slot->device->sysfd_subscription);
-                uevent_subscription_destroy(&slot->device->sysfd_subscription);
-                c_close(slot->device->sysfd);
+        if (!c_list_first(&device->sysfd_callbacks) && device->sysfd_queued) {
+                c_list_remove(&device->manager->sysfd_queue, &device->sysfd_queue_le);
+                device->sysfd_queued = false;
         }
 
-        free(slot);
+        arena_put(device->manager->arena, slot, sizeof(*slot));
 
         return NULL;
 }
 
-static void device_slot_freep(struct device_slot **slotp) {
-        device_slot_free(*slotp);
-}
-
 static int device_slot_new(struct device *device, struct device_slot **slotp,
                            device_callback_t cb, void *userdata) {
         struct device_slot *slot;
 
-        slot = malloc(sizeof(*slot));
+        slot = arena_get(device->manager->arena, sizeof(*slot));
         if (!slot)
                 return -ENOMEM;
 
@@ -280,46 +471,122 @@ static int device_slot_new(struct device *device, struct device_slot **slotp,
         slot->device = device;
         c_list_entry_init(&slot->le);
 
-        c_list_prepend(&device->sysfd_callbacks, &slot->le);
+        c_list_append(&device->sysfd_callbacks, &slot->le);
+
+        *slotp = slot;
 
         return 0;
 }
 
+static void device_sysfd_close(struct device *device) {
+        Manager *m = device->manager;
+
+        if (device->sysfd < 0)
+                return;
+
+        c_list_remove(&m->sysfds, &device->sysfd_le);
+        device->sysfd = c_close(device->sysfd);
+        m->n_sysfds--;
+}
+
+/* The sysfds stay open after the callbacks ran; the least recently used ones
+ * are closed when the budget is exhausted, and reopened on demand. */
+static int device_sysfd_get(struct device *device) {
+        Manager *m = device->manager;
+        char devpath[PATH_MAX];
+        CListEntry *le;
+        int r, fd;
+
+        if (device->sysfd >= 0) {
+                c_list_remove(&m->sysfds, &device->sysfd_le);
+                c_list_append(&m->sysfds, &device->sysfd_le);
+                m->metrics.n_sysfd_hits++;
+
+                return device->sysfd;
+        }
+
+        r = device_get_devpath(device, devpath, sizeof(devpath));
+        if (r < 0)
+                return r;
+
+        fd = openat(m->devicesfd, devpath, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (fd < 0)
+                return -errno;
+
+        m->metrics.n_sysfd_opens++;
+
+        while (m->n_sysfds >= m->max_sysfds && (le = c_list_first(&m->sysfds))) {
+                device_sysfd_close(c_container_of(le, struct device, sysfd_le));
+                m->metrics.n_sysfd_evictions++;
+        }
+
+        device->sysfd = fd;
+        c_list_append(&m->sysfds, &device->sysfd_le);
+        m->n_sysfds++;
+
+        return fd;
+}
+
+/* Run the callbacks of all devices queued before the subscription was armed,
+ * the ones queued later wait for the next sync. */
 static int device_sysfd_cb(void *userdata) {
-        struct device *device = userdata;
+        Manager *m = userdata;
+        uint64_t batch;
         CListEntry *le;
 
-        assert(device);
+        assert(m);
 
-        while ((le = c_list_first(&device->sysfd_callbacks))) {
-                struct device_slot *slot = c_container_of(le, struct device_slot, le);
+        batch = m->sysfd_batch;
 
-                slot->cb(device, device->sysfd, slot->userdata);
-                device_slot_free(slot);
+        while ((le = c_list_first(&m->sysfd_queue))) {
+                struct device *device = c_container_of(le, struct device, sysfd_queue_le);
+                int fd;
+
+                if (device->sysfd_batch == batch)
+                        break;
+
+                c_list_remove(&m->sysfd_queue, &device->sysfd_queue_le);
+                device->sysfd_queued = false;
+
+                fd = device_sysfd_get(device);
+
+                /* A callback might queue the device again. */
+                while (!device->sysfd_queued && (le = c_list_first(&device->sysfd_callbacks))) {
+                        struct device_slot *slot = c_container_of(le, struct device_slot, le);
+
+                        slot->cb(device, fd, slot->userdata);
+                        device_slot_free(slot);
+                }
         }
 
-        c_close(device->sysfd);
+        m->sysfd_syncing = false;
 
         return 0;
 }
 
-static int device_sysfd_open(struct device *device) {
-        _c_cleanup_(c_closep) int fd = -1;
+/* One subscription serves all devices queued since the previous one, returns
+ * 1 if it was armed. */
+int device_sysfd_sync(Manager *m) {
         int r;
 
-        fd = openat(device->manager->devicesfd, device->devpath, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-        if (fd < 0)
-                return -errno;
+        if (m->sysfd_syncing || !c_list_first(&m->sysfd_queue))
+                return 0;
 
-        r = uevent_sysfs_sync(&device->manager->uevent_subscriptions, device->manager->sysfd,
-                              &device->sysfd_subscription, device_sysfd_cb, device);
+        r = uevent_sysfs_sync(&m->uevent_subscriptions, m->sysfd,
+                              &m->sysfd_subscription, device_sysfd_cb, m);
         if (r < 0)
                 return r;
 
-        device->sysfd = fd;
-        fd = -1;
+        m->sysfd_syncing = true;
+        m->sysfd_batch++;
+        m->metrics.n_sysfd_batches++;
 
-        return 0;
+        return 1;
+}
+
+/* The devname is stored behind the device. */
+static size_t device_size(const char *devname) {
+        return sizeof(struct device) + (devname ? strlen(devname) + 1 : 0);
 }
 
 struct device *device_free(struct device *device) {
@@ -336,12 +603,10 @@ struct device *device_free(struct device *device) {
                 device_slot_free(slot);
         }
 
-        c_close(device->sysfd);
+        device_sysfd_close(device);
 
-        uevent_subscription_unlink(&device->manager->uevent_subscriptions, &device->sysfd_subscription);
-        uevent_subscription_destroy(&device->sysfd_subscription);
-
-        free(device);
+        intern_put(device->manager->properties, device->modalias);
+        arena_put(device->manager->arena, device, device_size(device->devname));
 
         return NULL;
 }
@@ -350,39 +615,41 @@ static void device_freep(struct device **devicep) {
         device_free(*devicep);
 }
 
-static int device_new(Manager *m, struct device **devicep, const char *devpath,
+static int device_new(Manager *m, struct device **devicep,
                       struct devtype *devtype, const char *devname, const char *modalias) {
         _c_cleanup_(device_freep) struct device *device = NULL;
-        size_t n_devpath, n_devname, n_modalias;
 
         assert(m);
         assert(devicep);
-        assert(devpath);
 
-        n_devpath = strlen(devpath) + 1;
-        n_devname = devname ? strlen(devname) + 1 : 0;
-        n_modalias = modalias ? strlen(modalias) + 1 : 0;
-        device = malloc(sizeof(*device) + n_devpath + n_devname + n_modalias);
+        device = arena_get(m->arena, device_size(devname));
         if (!device)
                 return -ENOMEM;
 
         device->manager = m;
+        device->generation = m->generation;
         device->sysfd = -1;
-        uevent_subscription_init(&device->sysfd_subscription);
+        c_list_entry_init(&device->sysfd_le);
         c_list_init(&device->sysfd_callbacks);
-        c_rbnode_init(&device->rb);
+        device->sysfd_queued = false;
+        device->sysfd_batch = 0;
+        c_list_entry_init(&device->sysfd_queue_le);
+        device->node = NULL;
+        device->pending = false;
+        c_list_entry_init(&device->pending_le);
         c_list_entry_init(&device->le);
         /* A NULL devtype indicates that the device should consume events but
          * not be exposed. */
         device->devtype = devtype;
-        device->devpath = memcpy((void*)(device + 1), devpath, n_devpath);
-        device->devname = memcpy((char*)device->devpath + n_devpath, devname, n_devname);
-        device->modalias = memcpy((char*)device->devname + n_devname, modalias, n_modalias);
-
-        if (!devname)
-                device->devname = NULL;
-        if (!modalias)
-                device->modalias = NULL;
+        device->devname = devname ? strcpy((char *)(device + 1), devname) : NULL;
+        device->modalias = NULL;
+
+        /* Many devices of the same kind share their modalias. */
+        if (modalias) {
+                device->modalias = intern_get(m->properties, modalias, strlen(modalias));
+                if (!device->modalias)
+                        return -ENOMEM;
+        }
 
         *devicep = device;
         device = NULL;
@@ -394,7 +661,7 @@ static int device_change(Manager *m, struct device **devicep, const char *devpat
                          const char *devname, const char *modalias) {
         struct device *device;
 
-        device = device_get_by_devpath(&m->devices, devpath);
+        device = device_get_by_devpath(m, devpath);
         if (!device) {
                 if (m->settled)
                         kmsg(LOG_WARNING, "Unexpected CHANGE: %s\n", devpath);
@@ -411,8 +678,8 @@ int device_add(Manager *m, struct device **devicep, const char *devpath,
                const char *devname, const char *modalias) {
         struct subsystem *subsystem;
         struct devtype *devtype;
+        struct device_node *node;
         struct device *device;
-        CRBNode **slot, *p;
         int r;
 
         assert(m);
@@ -420,8 +687,11 @@ int device_add(Manager *m, struct device **devicep, const char *devpath,
         assert(devpath);
         assert(subsystem_name);
 
-        slot = c_rbtree_find_slot(&m->devices, devices_compare, devpath, &p);
-        if (!slot) {
+        r = device_node_add(m, &node, devpath);
+        if (r < 0)
+                return r;
+
+        if (node->device) {
                 if (m->settled) {
                         kmsg(LOG_WARNING, "Unexpected ADD: %s\n", devpath);
                         return 0;
@@ -432,22 +702,23 @@ int device_add(Manager *m, struct device **devicep, const char *devpath,
         }
 
         r = subsystem_add(m, &subsystem, subsystem_name);
-        if (r < 0)
-                return r;
-
-        r = devtype_add(subsystem, &devtype, devtype_name);
-        if (r < 0)
-                return r;
-
-        r = device_new(m, &device, devpath, devtype, devname, modalias);
-        if (r < 0)
+        if (r >= 0)
+                r = devtype_add(subsystem, &devtype, devtype_name);
+        if (r >= 0)
+                r = device_new(m, &device, devtype, devname, modalias);
+        if (r < 0) {
+                device_node_release(m, node);
                 return r;
+        }
 
-        c_rbtree_add(&m->devices, p, slot, &device->rb);
+        device->node = node;
+        node->device = device;
 
         if (devtype)
                 c_list_prepend(&devtype->devices, &device->le);
 
+        m->snapshot_dirty = true;
+
         if (m->settled && !device->devtype)
                 kmsg(LOG_WARNING, "ADD event suppressed for invalid subsystem '%s': %s\n", subsystem_name, devpath);
 
@@ -459,7 +730,7 @@ int device_add(Manager *m, struct device **devicep, const char *devpath,
 static int device_remove(Manager *m, const char *devpath) {
         struct device *device;
 
-        device = device_get_by_devpath(&m->devices, devpath);
+        device = device_get_by_devpath(m, devpath);
         if (!device) {
                 if (m->settled)
                         kmsg(LOG_WARNING, "Unexpected REMOVE: %s\n", devpath);
@@ -473,195 +744,107 @@ static int device_remove(Manager *m, const char *devpath) {
         device_unlink(device);
         device_free(device);
 
-        return 0;
-}
-
-static int device_move_one(Manager *m, struct device **devicep, struct device *device_old, const char *devpath) {
-        _c_cleanup_(device_freep) struct device *device = NULL;
-        CRBNode **slot, *p;
-        int r;
-
-        assert(m);
-        assert(device_old);
-        assert(devpath);
-
-        slot = c_rbtree_find_slot(&m->devices, devices_compare, devpath, &p);
-        if (!slot) {
-                kmsg(LOG_WARNING, "Unexpected MOVE: %s -> %s\n", device_old->devpath, devpath);
-                return 0;
-        }
-
-        r = device_new(m, &device, devpath, device_old->devtype, device_old->devname, device_old->modalias);
-        if (r < 0)
-                return r;
-
-        if (c_list_first(&device_old->sysfd_callbacks)) {
-                device->sysfd_callbacks = device_old->sysfd_callbacks;
-                c_list_init(&device_old->sysfd_callbacks);
-
-                r = device_sysfd_open(device);
-                if (r < 0)
-                        return r;
-        }
-
-        device_unlink(device_old);
-        device_free(device_old);
-        c_rbtree_add(&m->devices, p, slot, &device->rb);
-
-        if (devicep)
-                *devicep = device;
-        device = NULL;
-
         return 1;
 }
 
-
 static int device_move(Manager *m, struct device **devicep, const char *devpath_old, const char *devpath) {
-        _c_cleanup_(device_freep) struct device *device = NULL;
-        struct device *device_old, *subdevice_next;
-        char subdevpath[PATH_MAX];
+        struct device *device;
+        struct device_node *node, *parent = NULL, *parent_old;
+        struct component component;
+        const char *name;
+        const char *s;
+        CRBNode **slot, *p;
         int r;
 
-        /* devpath is guaranteed to fit in PATH_MAX */
-        strcpy(subdevpath, devpath);
+        /* A MOVE event is empty apart from the DEVPATH change. The node of the
+         * device is relinked with its new name, the devices below it move
+         * along. If we are in the process of resolving the DEVPATH, we need
+         * to restart that with the new DEVPATH value. */
 
-        /* A MOVE event is empty apart from the DEVPATH change, simply treat
-         * this as a REMOVE followed with an ADD containing the same data as the
-         * original device. However, if we are in the process of resolving the
-         * DEVPATH, we need to restart that with the new DEVPATH value. */
-
-        device_old = device_get_by_devpath(&m->devices, devpath_old);
-        if (!device_old) {
+        device = device_get_by_devpath(m, devpath_old);
+        if (!device) {
                 if (m->settled)
                         kmsg(LOG_WARNING, "Unexpected MOVE: %s -> %s\n", devpath_old, devpath);
 
                 return 0;
         }
 
-        subdevice_next = device_get_next_by_devpath(device_old);
-
-        r = device_move_one(m, &device, device_old, devpath);
-        if (r <= 0)
-                return r;
-
-        while (subdevice_next) {
-                struct device *subdevice;
-
-                subdevice = subdevice_next;
-
-                if (strstr(subdevice->devpath, devpath_old) != subdevice->devpath)
-                        /* not a child device */
-                        break;
+        if (device_node_lookup(m, devpath)) {
+                kmsg(LOG_WARNING, "Unexpected MOVE: %s -> %s\n", devpath_old, devpath);
+                return 0;
+        }
 
-                /* the new devpath is guaranteed to fit in PATH_MAX */
-                strcpy(subdevpath + strlen(devpath), subdevice->devpath + strlen(devpath_old));
+        /* Split off the new name, the parent path is created if needed. */
+        s = strrchr(devpath, '/');
+        if (s) {
+                _c_cleanup_(c_freep) char *devpath_parent = NULL;
 
-                subdevice_next = device_get_next_by_devpath(subdevice);
+                devpath_parent = strndup(devpath, s - devpath);
+                if (!devpath_parent)
+                        return -ENOMEM;
 
-                r = device_move_one(m, NULL, subdevice, subdevpath);
+                r = device_node_add(m, &parent, devpath_parent);
                 if (r < 0)
                         return r;
-        }
 
-        *devicep = device;
-        device = NULL;
-
-        return 1;
-}
-
-static ssize_t uevent_get_value(char *buf, size_t n_buf, const char *key, const char **valuep, char **nextp) {
-        char *end, *value;
-
-        end = memchr(buf, '\0', n_buf);
-        if (!end)
-                return -EBADMSG;
-
-        value = strchr(buf, '=');
-        if (!value)
-                return -EBADMSG;
-
-        if (strncmp(buf, key, value - buf) != 0)
-                return -EBADMSG;
-
-        value++;
-
-        *valuep = value;
-        *nextp = ++ end;
-
-        return n_buf - (end - buf);
-}
-
-static ssize_t uevent_get_last_value(char *buf, size_t n_buf, const char *key, uint64_t *nump) {
-        const char *k, *value;
-        uint64_t num;
-
-        if (n_buf == 0)
-                return -EBADMSG;
-
-        if (buf[n_buf - 1] != '\0')
-                return -EBADMSG;
-
-        value = memrchr(buf, '=', n_buf);
-        if (!value)
-                return -EBADMSG;
-
-        value ++;
-
-        n_buf = value - buf;
-        buf[n_buf - 1] = '\0';
+                s++;
+        } else
+                s = devpath;
 
-        k = memrchr(buf, '\0', n_buf - 1);
-        if (k)
-                k ++;
-        else
-                k = buf;
+        /* The new parent must not be below the device itself. */
+        for (struct device_node *n = parent; n; n = n->parent) {
+                if (n == device->node) {
+                        device_node_release(m, parent);
+                        return -EBADMSG;
+                }
+        }
 
-        if (strncmp(k, key, value - k) != 0)
+        if (!component_next(&s, &component)) {
+                device_node_release(m, parent);
                 return -EBADMSG;
+        }
 
-        errno = 0;
-        num = strtoull(value, NULL, 10);
-        if (errno != 0)
-                return -errno;
-
-        *nump = num;
+        name = intern_get(m->components, component.name, component.n_name);
+        if (!name) {
+                device_node_release(m, parent);
+                return -ENOMEM;
+        }
 
-        return k - buf;
-}
+        node = device->node;
+        parent_old = node->parent;
 
-static ssize_t uevent_get_key_value(char *buf, size_t n_buf, const char **keyp, const char **valuep, char **nextp) {
-        char *end, *value;
+        c_rbtree_remove(device_node_siblings(m, node), &node->rb);
+        intern_put(m->components, node->name);
+        node->name = name;
+        node->parent = parent;
 
-        end = memchr(buf, '\0', n_buf);
-        if (!end)
-                return -EBADMSG;
+        slot = c_rbtree_find_slot(device_node_siblings(m, node), device_nodes_compare, &component, &p);
+        assert(slot);
+        c_rbtree_add(device_node_siblings(m, node), p, slot, &node->rb);
 
-        value = strchr(buf, '=');
-        if (!value)
-                return -EBADMSG;
+        device_node_release(m, parent_old);
+        m->snapshot_dirty = true;
 
-        *value = '\0';
-        value++;
+        /* Reopened with the new devpath when it is needed again. */
+        device_sysfd_close(device);
 
-        *keyp = buf;
-        *valuep = value;
-        *nextp = ++ end;
+        *devicep = device;
 
-        return n_buf - (end - buf);
+        return 1;
 }
 
-
 int device_from_nulstr(Manager *m, struct device **devicep, int *actionp,
                        uint64_t *seqnump, char *buf, size_t n_buf) {
         struct device *device = NULL;
-        ssize_t buflen = n_buf;
-        const char *action_string;
+        struct uevent_fields fields;
         const char *devpath;
         const char *subsystem;
-        const char *devpath_old;
-        const char *devtype = NULL;
-        const char *devname = NULL;
-        const char *modalias = NULL;
+        const char *devpath_old = NULL;
+        const char *devtype;
+        const char *devname;
+        const char *modalias;
+        struct subsystem *counted;
+        bool hidden = false;
         int action;
         uint64_t seqnum;
         int r;
@@ -672,36 +855,39 @@ int device_from_nulstr(Manager *m, struct device **devicep, int *actionp,
         assert(seqnump);
         assert(buf);
 
-        /* the first three and the last properties are fixed */
-        buflen = uevent_get_value(buf, buflen, "ACTION", &action_string, &buf);
-        if (buflen < 0)
-                return buflen;
-        else {
-                action = uevent_action_from_string(action_string);
-                if (action < 0)
-                        return action;
-        }
+        r = uevent_parse(buf, n_buf, '\0', &fields);
+        if (r < 0)
+                return r;
 
-        buflen = uevent_get_value(buf, buflen, "DEVPATH", &devpath, &buf);
-        if (buflen < 0)
-                return buflen;
+        if (!fields.values[UEVENT_FIELD_ACTION] ||
+            !fields.values[UEVENT_FIELD_DEVPATH] ||
+            !fields.values[UEVENT_FIELD_SUBSYSTEM] ||
+            !fields.values[UEVENT_FIELD_SEQNUM])
+                return -EBADMSG;
+
+        action = uevent_action_from_string(fields.values[UEVENT_FIELD_ACTION]);
+        if (action < 0)
+                return action;
+
+        m->metrics.n_uevents_action[action]++;
 
         /* Store path relative to /sys/devices/, so drop the prefix. DEVPATHs
          * with other prefixes (/sys/modules etc) are ignored. */
+        devpath = fields.values[UEVENT_FIELD_DEVPATH];
         if (strncmp(devpath, "/devices/", strlen("/devices/")) != 0)
                 return 0;
 
         devpath += strlen("/devices/");
 
-        buflen = uevent_get_value(buf, buflen, "SUBSYSTEM", &subsystem, &buf);
-        if (buflen < 0)
-                return buflen;
+        subsystem = fields.values[UEVENT_FIELD_SUBSYSTEM];
+        counted = subsystem_get(m, subsystem);
+        if (counted)
+                counted->n_uevents++;
 
         if (action == UEVENT_ACTION_MOVE) {
-                /* a MOVE event only contains one other property */
-                buflen = uevent_get_value(buf, buflen, "DEVPATH_OLD", &devpath_old, &buf);
-                if (buflen < 0)
-                        return buflen;
+                devpath_old = fields.values[UEVENT_FIELD_DEVPATH_OLD];
+                if (!devpath_old)
+                        return -EBADMSG;
 
                 /* MOVE only maks sense for real devices */
                 if (strncmp(devpath_old, "/devices/", strlen("/devices/")) != 0)
@@ -710,24 +896,24 @@ int device_from_nulstr(Manager *m, struct device **devicep, int *actionp,
                 devpath_old += strlen("/devices/");
         }
 
-        buflen = uevent_get_last_value(buf, buflen, "SEQNUM", &seqnum);
-        if (buflen < 0)
-                return buflen;
+        errno = 0;
+        seqnum = strtoull(fields.values[UEVENT_FIELD_SEQNUM], NULL, 10);
+        if (errno != 0)
+                return -errno;
 
-        while (buflen > 0) {
-                const char *key, *value;
+        /* Gaps in the seqnum are the events filtered by the kernel. */
+        if (m->seqnum_last > 0 && seqnum > m->seqnum_last)
+                m->metrics.n_uevents_filtered += seqnum - m->seqnum_last - 1;
+        if (seqnum > m->seqnum_last)
+                m->seqnum_last = seqnum;
 
-                buflen = uevent_get_key_value(buf, buflen, &key, &value, &buf);
-                if (buflen < 0)
-                        return buflen;
+        /* The event is already covered by a resync with /sys. */
+        if (seqnum <= m->seqnum_resync)
+                return 0;
 
-                if (strcmp(key, "DEVTYPE") == 0)
-                        devtype = value;
-                else if (strcmp(key, "DEVNAME") == 0)
-                        devname = value;
-                else if (strcmp(key, "MODALIAS") == 0)
-                        modalias = value;
-        }
+        devtype = fields.values[UEVENT_FIELD_DEVTYPE];
+        devname = fields.values[UEVENT_FIELD_DEVNAME];
+        modalias = fields.values[UEVENT_FIELD_MODALIAS];
 
         /* We assume that /sys has been enumerated before any uevents are being
          * processed. We also assume that no spurious event take place (udevadm
@@ -748,9 +934,14 @@ int device_from_nulstr(Manager *m, struct device **devicep, int *actionp,
                         return r;
                 break;
         case UEVENT_ACTION_REMOVE:
+                device = device_get_by_devpath(m, devpath);
+                hidden = device && !device_is_published(device);
+                device = NULL;
+
                 r = device_remove(m, devpath);
                 if (r <= 0)
                         return r;
+                break;
         case UEVENT_ACTION_MOVE:
                 r = device_move(m, &device, devpath_old, devpath);
                 if (r <= 0)
@@ -760,31 +951,47 @@ int device_from_nulstr(Manager *m, struct device **devicep, int *actionp,
                 return -EBADMSG;
         }
 
+        /* The manager defers the side effects of a new device, its ADD
+         * is queued by manager_flush_pending(). Unpublished devices are
+         * not in the snapshot either. */
+        if (action == UEVENT_ACTION_ADD && m->settled && m->coalesce_usec > 0)
+                hidden = true;
+        else if (device && !device_is_published(device))
+                hidden = true;
+
+        if (!hidden)
+                monitor_queue(m->monitor, action, seqnum, devpath, devpath_old, subsystem, devtype, devname, modalias);
+
+        /* The device is NULL after a REMOVE. */
         *devicep = device;
         *actionp = action;
         *seqnump = seqnum;
         return 1;
 }
 
+/* Call back with an O_PATH fd of the device directory, as soon as sysfs
+ * caught up with the kernel seqnum at the time of the call. The callbacks are
+ * queued, device_sysfd_sync() waits for the kernel once for all of them. */
 int device_call_with_sysfd(struct device *device, struct device_slot **slotp,
                            device_callback_t cb, void *userdata) {
-        _c_cleanup_(device_slot_freep) struct device_slot *slot = NULL;
+        Manager *m = device->manager;
+        struct device_slot *slot;
         int r;
 
         r = device_slot_new(device, &slot, cb, userdata);
         if (r < 0)
                 return r;
 
-        if (device->sysfd < 0) {
-                r = device_sysfd_open(device);
-                if (r < 0)
-                        return r;
-        }
+        /* Earlier callbacks of the device move to the later batch. */
+        if (device->sysfd_queued)
+                c_list_remove(&m->sysfd_queue, &device->sysfd_queue_le);
+
+        device->sysfd_queued = true;
+        device->sysfd_batch = m->sysfd_batch;
+        c_list_append(&m->sysfd_queue, &device->sysfd_queue_le);
 
         if (slotp)
                 *slotp = slot;
 
-        slot = NULL;
-
         return 0;
 }
@@ -23,11 +23,20 @@
 
 typedef int (*device_callback_t)(struct device *device, int sysfd, void *userdata);
 
+/* A component of a devpath, the devices are stored in a tree of their
+ * path components below /sys/devices. */
+struct device_node {
+        struct device_node *parent;     /* NULL at the top level. */
+        const char *name;               /* Interned in the components. */
+        CRBNode rb;                     /* In the children of the parent. */
+        CRBTree children;
+        struct device *device;          /* NULL if the path is no device. */
+};
+
 struct device {
         Manager *manager;
 
-        CRBNode rb;
-        const char *devpath;
+        struct device_node *node;
 
         CListEntry le;
         struct devtype *devtype;
@@ -35,15 +44,24 @@ struct device {
         const char *devname;
         const char *modalias;
 
-        int sysfd;
-        struct uevent_subscription sysfd_subscription;
+        unsigned int generation;        /* Last /sys enumeration the device was seen in. */
+
+        bool pending;                   /* The ADD side effects are deferred. */
+        CListEntry pending_le;
+
+        int sysfd;                      /* Cached, see device_call_with_sysfd(). */
+        CListEntry sysfd_le;            /* In the manager's least recently used list. */
         CList sysfd_callbacks;
+        bool sysfd_queued;              /* Waiting for a sysfs sync. */
+        uint64_t sysfd_batch;
+        CListEntry sysfd_queue_le;
 };
 
 struct subsystem {
         Manager *manager;
         const char *name;
         CRBNode rb;
+        uint64_t n_uevents;
 
         CRBTree devtypes;
 };
@@ -52,6 +70,7 @@ struct devtype {
         struct subsystem *subsystem;
         const char *name;
         CRBNode rb;
+        struct permissions_devtype *permissions;        /* Compiled on first use. */
 
         CList devices;
 };
@@ -64,7 +83,13 @@ struct device_slot {
 };
 
 int device_call_with_sysfd(struct device *device, struct device_slot **slot, device_callback_t cb, void *userdata);
+int device_sysfd_sync(Manager *m);
 int device_from_nulstr(Manager *m, struct device **devicep, int *action, uint64_t *seqnum, char *buf, size_t n_buf);
+struct device *device_get_by_devpath(Manager *m, const char *devpath);
+struct device *device_first(Manager *m);
+struct device *device_next(struct device *device);
+bool device_is_published(struct device *device);
+int device_get_devpath(struct device *device, char *devpath, size_t n_devpath);
 void device_unlink(struct device *device);
 struct device *device_free(struct device *device);
 
@@ -75,4 +100,5 @@ int device_add(Manager *m, struct device **devicep, const char *devpath,
 int devtype_add(struct subsystem *subsystem, struct devtype **devtypep, const char *name);
 
 int subsystem_add(Manager *m, struct subsystem **subsystemp, const char *name);
+struct subsystem *subsystem_get(Manager *m, const char *name);
 struct subsystem *subsystem_free(struct subsystem *subsystem);
@@ -0,0 +1,168 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <string.h>
+#include "intern.h"
+
+/* A set of reference counted strings, every distinct string is stored
+ * once and can be compared by its pointer. */
+
+struct intern_string {
+        struct intern_string *next;
+        size_t hash;
+        unsigned int n_refs;
+        char string[];
+};
+
+struct Intern {
+        struct intern_string **buckets;
+        size_t n_buckets;
+        size_t n_strings;
+};
+
+static size_t intern_hash(const char *string, size_t n_string) {
+        size_t hash = 14695981039346656037ULL;
+
+        /* FNV-1a */
+        for (size_t i = 0; i < n_string; i++) {
+                hash ^= (unsigned char)string[i];
+                hash *= 1099511628211ULL;
+        }
+
+        return hash;
+}
+
+Intern *intern_free(Intern *intern) {
+        if (!intern)
+                return NULL;
+
+        for (size_t i = 0; i < intern->n_buckets; i++) {
+                while (intern->buckets[i]) {
+                        struct intern_string *s = intern->buckets[i];
+
+                        intern->buckets[i] = s->next;
+                        free(s);
+                }
+        }
+
+        free(intern->buckets);
+        free(intern);
+
+        return NULL;
+}
+
+int intern_new(Intern **internp) {
+        _c_cleanup_(intern_freep) Intern *intern = NULL;
+
+        intern = calloc(1, sizeof(Intern));
+        if (!intern)
+                return -ENOMEM;
+
+        intern->n_buckets = 256;
+        intern->buckets = calloc(intern->n_buckets, sizeof(struct intern_string *));
+        if (!intern->buckets)
+                return -ENOMEM;
+
+        *internp = intern;
+        intern = NULL;
+
+        return 0;
+}
+
+static void intern_grow(Intern *intern) {
+        struct intern_string **buckets;
+        size_t n_buckets = intern->n_buckets * 2;
+
+        /* Keep the old table if we are out of memory, lookups get slower. */
+        buckets = calloc(n_buckets, sizeof(struct intern_string *));
+        if (!buckets)
+                return;
+
+        for (size_t i = 0; i < intern->n_buckets; i++) {
+                while (intern->buckets[i]) {
+                        struct intern_string *s = intern->buckets[i];
+
+                        intern->buckets[i] = s->next;
+                        s->next = buckets[s->hash & (n_buckets - 1)];
+                        buckets[s->hash & (n_buckets - 1)] = s;
+                }
+        }
+
+        free(intern->buckets);
+        intern->buckets = buckets;
+        intern->n_buckets = n_buckets;
+}
+
+/* Returns a reference to the interned copy of the string, or NULL if we
+ * are out of memory. */
+const char *intern_get(Intern *intern, const char *string, size_t n_string) {
+        struct intern_string *s;
+        size_t hash;
+
+        hash = intern_hash(string, n_string);
+
+        for (s = intern->buckets[hash & (intern->n_buckets - 1)]; s; s = s->next) {
+                if (s->hash != hash)
+                        continue;
+
+                if (strncmp(s->string, string, n_string) != 0 || s->string[n_string] != '\0')
+                        continue;
+
+                s->n_refs++;
+                return s->string;
+        }
+
+        s = malloc(sizeof(*s) + n_string + 1);
+        if (!s)
+                return NULL;
+
+        s->hash = hash;
+        s->n_refs = 1;
+        memcpy(s->string, string, n_string);
+        s->string[n_string] = '\0';
+
+        s->next = intern->buckets[hash & (intern->n_buckets - 1)];
+        intern->buckets[hash & (intern->n_buckets - 1)] = s;
+
+        if (++intern->n_strings > intern->n_buckets)
+                intern_grow(intern);
+
+        return s->string;
+}
+
+void intern_put(Intern *intern, const char *string) {
+        struct intern_string *s, **slot;
+
+        if (!string)
+                return;
+
+        s = (struct intern_string *)(string - offsetof(struct intern_string, string));
+        if (--s->n_refs > 0)
+                return;
+
+        for (slot = &intern->buckets[s->hash & (intern->n_buckets - 1)]; *slot; slot = &(*slot)->next) {
+                if (*slot != s)
+                        continue;
+
+                *slot = s->next;
+                break;
+        }
+
+        intern->n_strings--;
+        free(s);
+}
@@ -0,0 +1,27 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+typedef struct Intern Intern;
+
+Intern *intern_free(Intern *intern);
+int intern_new(Intern **internp);
+
+const char *intern_get(Intern *intern, const char *string, size_t n_string);
+void intern_put(Intern *intern, const char *string);
+
+C_DEFINE_CLEANUP(Intern *, intern_free);
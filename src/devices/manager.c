@@ -16,37 +16,48 @@
 ***/
 
 #include <c-macro.h>
+#include <c-usec.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <signal.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/prctl.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <org.bus1/b1-devices-events.h>
+#include <org.bus1/b1-devices-snapshot.h>
 #include <org.bus1/b1-identity.h>
 #include "device.h"
 #include "manager.h"
+#include "metrics.h"
 #include "module.h"
+#include "monitor.h"
 #include "permissions.h"
+#include "shared/kernel-cmdline.h"
 #include "shared/kmsg.h"
+#include "snapshot.h"
 #include "sysfs.h"
 #include "uevent.h"
 
 Manager *manager_free(Manager *m) {
+        struct device *device;
         CRBNode *n;
-        struct work_item *w;
+
+        /* Wait for the module workers before the devices go away. */
+        m->module_pool = module_pool_free(m->module_pool);
 
         c_close(m->fd_ep);
         c_close(m->fd_uevent);
         c_close(m->fd_signal);
+        c_close(m->fd_timer);
         c_close(m->sysfd);
         c_close(m->devfd);
         c_close(m->devicesfd);
         c_close(m->sysbusfd);
         c_close(m->sysclassfd);
 
-        while ((n = c_rbtree_first(&m->devices))) {
-                struct device *device = c_container_of(n, struct device, rb);
-
+        while ((device = device_first(m))) {
                 device_unlink(device);
                 device_free(device);
         }
@@ -58,16 +69,16 @@ Manager *manager_free(Manager *m) {
                 subsystem_free(subsystem);
         }
 
-        pthread_mutex_lock(&m->worker_lock);
-        while ((w = work_item_pop(m)))
-                work_item_free(w);
-        pthread_mutex_unlock(&m->worker_lock);
-
-        pthread_mutex_destroy(&m->worker_lock);
-
+        monitor_free(m->monitor);
         uevent_subscription_unlink(&m->uevent_subscriptions, &m->subscription_settle);
         uevent_subscription_destroy(&m->subscription_settle);
+        uevent_subscription_unlink(&m->uevent_subscriptions, &m->sysfd_subscription);
+        uevent_subscription_destroy(&m->sysfd_subscription);
         uevent_subscriptions_destroy(&m->uevent_subscriptions);
+        intern_free(m->properties);
+        intern_free(m->components);
+        arena_free(m->arena);
+        permissions_free(m->permissions);
         if (m->log)
                 fclose(m->log);
         free(m);
@@ -89,11 +100,28 @@ static size_t manager_get_max_workers(void) {
         return CPU_COUNT(&cpu_set) + 4;
 }
 
-int manager_new(Manager **manager) {
+static size_t manager_get_max_sysfds(void) {
+        _c_cleanup_(c_freep) char *value = NULL;
+        unsigned long n;
+        char *end;
+
+        if (kernel_cmdline_option("org.bus1.devices.sysfds", &value) <= 0 || !value)
+                return MANAGER_SYSFDS_MAX;
+
+        errno = 0;
+        n = strtoul(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || n == 0) {
+                kmsg(LOG_WARNING, "Invalid sysfd budget '%s', using %u.", value, MANAGER_SYSFDS_MAX);
+                return MANAGER_SYSFDS_MAX;
+        }
+
+        return n;
+}
+
+/* The parts of the manager which do not need the kernel, the device tree
+ * is built on top of @sysfd, which is duplicated. */
+int manager_new_at(Manager **manager, int sysfd) {
         _c_cleanup_(manager_freep) Manager *m = NULL;
-        struct epoll_event ep_uevent = { .events = EPOLLIN };
-        struct epoll_event ep_signal = { .events = EPOLLIN };
-        sigset_t mask;
         int r;
 
         m = calloc(1, sizeof(Manager));
@@ -102,6 +130,7 @@ int manager_new(Manager **manager) {
 
         m->fd_uevent = -1;
         m->fd_signal = -1;
+        m->fd_timer = -1;
         m->fd_ep = -1;
         m->devfd = -1;
         m->sysfd = -1;
@@ -109,15 +138,16 @@ int manager_new(Manager **manager) {
         m->sysbusfd = -1;
         m->sysclassfd = -1;
 
-        m->log = kmsg(0, NULL);
-        if (!m->log)
-                return -errno;
-
-        m->devfd = openat(AT_FDCWD, "/dev", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
-        if (m->devfd < 0)
-                return -errno;
+        c_list_init(&m->pending_devices);
+        m->coalesce_usec = MANAGER_COALESCE_USEC;
+        c_list_init(&m->sysfds);
+        c_list_init(&m->sysfd_queue);
+        uevent_subscription_init(&m->subscription_settle);
+        uevent_subscription_init(&m->sysfd_subscription);
+        m->max_sysfds = MANAGER_SYSFDS_MAX;
+        m->max_workers = manager_get_max_workers();
 
-        m->sysfd = openat(AT_FDCWD, "/sys", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        m->sysfd = fcntl(sysfd, F_DUPFD_CLOEXEC, 3);
         if (m->sysfd < 0)
                 return -errno;
 
@@ -133,10 +163,59 @@ int manager_new(Manager **manager) {
         if (m->sysclassfd < 0)
                 return -errno;
 
+        r = arena_new(&m->arena);
+        if (r < 0)
+                return r;
+
+        r = intern_new(&m->components);
+        if (r < 0)
+                return r;
+
+        r = intern_new(&m->properties);
+        if (r < 0)
+                return r;
+
         r = uevent_subscriptions_init(&m->uevent_subscriptions, m->sysfd);
         if (r < 0)
                 return r;
 
+        *manager = m;
+        m = NULL;
+
+        return 0;
+}
+
+int manager_new(Manager **manager) {
+        _c_cleanup_(manager_freep) Manager *m = NULL;
+        _c_cleanup_(c_closep) int sysfd = -1;
+        struct epoll_event ep_uevent = { .events = EPOLLIN };
+        struct epoll_event ep_signal = { .events = EPOLLIN };
+        struct epoll_event ep_timer = { .events = EPOLLIN };
+        sigset_t mask;
+        int r;
+
+        sysfd = openat(AT_FDCWD, "/sys", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (sysfd < 0)
+                return -errno;
+
+        r = manager_new_at(&m, sysfd);
+        if (r < 0)
+                return r;
+
+        m->max_sysfds = manager_get_max_sysfds();
+
+        m->log = kmsg(0, NULL);
+        if (!m->log)
+                return -errno;
+
+        m->devfd = openat(AT_FDCWD, "/dev", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC|O_PATH);
+        if (m->devfd < 0)
+                return -errno;
+
+        r = permissions_new(&m->permissions, PERMISSIONS_RULES_DIR);
+        if (r < 0)
+                return r;
+
         m->fd_uevent = uevent_connect();
         if (m->fd_uevent < 0)
                 return m->fd_uevent;
@@ -145,28 +224,30 @@ int manager_new(Manager **manager) {
         sigaddset(&mask, SIGTERM);
         sigaddset(&mask, SIGINT);
         sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGUSR1);
         sigprocmask(SIG_BLOCK, &mask, NULL);
 
         m->fd_signal = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
         if (m->fd_signal < 0)
                 return -errno;
 
+        m->fd_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        if (m->fd_timer < 0)
+                return -errno;
+
         m->fd_ep = epoll_create1(EPOLL_CLOEXEC);
         if (m->fd_ep < 0)
                 return -errno;
 
         ep_uevent.data.fd = m->fd_uevent;
         ep_signal.data.fd = m->fd_signal;
+        ep_timer.data.fd = m->fd_timer;
 
         if (epoll_ctl(m->fd_ep, EPOLL_CTL_ADD, m->fd_uevent, &ep_uevent) < 0 ||
-            epoll_ctl(m->fd_ep, EPOLL_CTL_ADD, m->fd_signal, &ep_signal) < 0)
+            epoll_ctl(m->fd_ep, EPOLL_CTL_ADD, m->fd_signal, &ep_signal) < 0 ||
+            epoll_ctl(m->fd_ep, EPOLL_CTL_ADD, m->fd_timer, &ep_timer) < 0)
                 return -errno;
 
-        pthread_mutex_init(&m->worker_lock, NULL);
-        c_list_init(&m->work_items);
-        m->n_workers = 0;
-        m->max_workers = manager_get_max_workers();
-
         *manager = m;
         m = NULL;
 
@@ -190,8 +271,45 @@ static int sysfs_cb(const char *devpath, const char *subsystem,
         return 0;
 }
 
+/* Queue an event for a device whose uevent the subscribers did not see. */
+static void manager_queue_device(Manager *m, struct device *device, int action, uint64_t seqnum) {
+        char devpath[PATH_MAX];
+
+        /* Not exposed, like in the snapshot. */
+        if (!device_is_published(device))
+                return;
+
+        if (device_get_devpath(device, devpath, sizeof(devpath)) < 0)
+                return;
+
+        monitor_queue(m->monitor, action, seqnum, devpath, NULL,
+                      device->devtype->subsystem->name, device->devtype->name,
+                      device->devname, device->modalias);
+}
+
+/* Adjust the device node and load the module of a new device. */
+static int manager_device_added(Manager *m, struct device *device) {
+        int r;
+
+        if (device->devname) {
+                r = permissions_apply(m->permissions, m->devfd, device);
+                if (r < 0)
+                        return r;
+        }
+
+        if (device->modalias) {
+                r = module_load(m, device->devtype ? device->devtype->subsystem->name : NULL, device->modalias);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
 static int settle_cb(void *userdata) {
         Manager *m = userdata;
+        _c_cleanup_(c_freep) struct device **devnodes = NULL;
+        size_t n_nodes = 0, n_nodes_max = 0;
         size_t n_devices = 0;
         int r;
 
@@ -200,17 +318,25 @@ static int settle_cb(void *userdata) {
         uevent_subscription_destroy(&m->subscription_settle);
         m->settled = true;
 
-        for (CRBNode *n = c_rbtree_first(&m->devices); n; n = c_rbnode_next(n)) {
-                struct device *device = c_container_of(n, struct device, rb);
-
+        for (struct device *device = device_first(m); device; device = device_next(device)) {
                 if (device->devname) {
-                        r = permissions_apply(m->devfd, device);
-                        if (r < 0)
-                                return r;
+                        struct device **nodes;
+
+                        if (n_nodes >= n_nodes_max) {
+                                n_nodes_max = n_nodes_max ? n_nodes_max * 2 : 256;
+                                nodes = realloc(devnodes, n_nodes_max * sizeof(struct device *));
+                                if (!nodes)
+                                        return -ENOMEM;
+
+                                devnodes = nodes;
+                        }
+
+                        devnodes[n_nodes++] = device;
                 }
 
+                /* Start loading the modules while the nodes are adjusted. */
                 if (device->modalias) {
-                        r = module_load(m, device->modalias);
+                        r = module_load(m, device->devtype ? device->devtype->subsystem->name : NULL, device->modalias);
                         if (r < 0)
                                 return r;
                 }
@@ -218,7 +344,28 @@ static int settle_cb(void *userdata) {
                 ++ n_devices;
         }
 
-        kmsg(LOG_INFO, "Coldplugged %zu devices.", n_devices);
+        r = permissions_apply_all(m->permissions, m->devfd, devnodes, n_nodes);
+        if (r < 0)
+                return r;
+
+        m->metrics.coldplug_usec = c_usec_from_clock(CLOCK_BOOTTIME) - m->metrics.coldplug_begin_usec;
+        kmsg(LOG_INFO, "Coldplugged %zu devices in %" PRIu64 " ms.", n_devices, m->metrics.coldplug_usec / 1000);
+
+        return 0;
+}
+
+/* Created after the privileges are dropped, like the other files in /run. */
+static int manager_listen(Manager *m) {
+        struct epoll_event ep_monitor = { .events = EPOLLIN };
+        int r;
+
+        r = monitor_new(&m->monitor, m, BUS1_DEVICES_EVENTS_SOCKET);
+        if (r < 0)
+                return r;
+
+        ep_monitor.data.fd = monitor_get_fd(m->monitor);
+        if (epoll_ctl(m->fd_ep, EPOLL_CTL_ADD, ep_monitor.data.fd, &ep_monitor) < 0)
+                return -errno;
 
         return 0;
 }
@@ -226,9 +373,14 @@ static int settle_cb(void *userdata) {
 int manager_enumerate(Manager *m) {
         int r;
 
+        r = manager_listen(m);
+        if (r < 0)
+                kmsg(LOG_WARNING, "Unable to listen on %s: %s.", BUS1_DEVICES_EVENTS_SOCKET, strerror(-r));
+
         kmsg(LOG_INFO, "Coldplug, adjust /dev permissions and load kernel modules for current devices.");
+        m->metrics.coldplug_begin_usec = c_usec_from_clock(CLOCK_BOOTTIME);
 
-        r = sysfs_enumerate(m->sysfd, sysfs_cb, m);
+        r = sysfs_enumerate_parallel(m->sysfd, sysfs_cb, m);
         if (r < 0)
                 return r;
 
@@ -239,79 +391,249 @@ int manager_enumerate(Manager *m) {
         return 0;
 }
 
+/* Subscriptions are not dispatched while side effects are deferred, a
+ * processed seqnum implies that its devices are set up. */
+static int manager_dispatch(Manager *m, uint64_t seqnum) {
+        if (c_list_first(&m->pending_devices))
+                return 0;
+
+        return uevent_subscriptions_dispatch(&m->uevent_subscriptions, seqnum);
+}
+
+static int manager_dispatch_idle(Manager *m) {
+        struct pollfd pfd = {
+                .fd = m->fd_uevent,
+                .events = EPOLLIN,
+        };
+        int r;
+
+        if (!c_list_first(&m->uevent_subscriptions.list))
+                return 0;
+
+        /* If we have subscribers, check if the uevent socket is
+         * idle before waiting. */
+        for (;;) {
+                r = poll(&pfd, 1, 0);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        return -errno;
+                } else
+                        break;
+        }
+
+        if (pfd.revents & EPOLLIN)
+                /* Pending uevents, so only dispatch subscriptions from
+                 * before any uevents were queued. */
+                return manager_dispatch(m, 0);
+
+        /* No pending uevents, the next one is guaranteed to be higher
+         * than all subscriptions, so dispatch all now */
+        return manager_dispatch(m, (uint64_t)-1);
+}
+
+/* Delay the side effects of a new device until the coalescing window ends,
+ * a REMOVE within the window cancels them. */
+static int manager_defer(Manager *m, struct device *device) {
+        struct itimerspec its = {};
+
+        if (device->pending)
+                return 0;
+
+        if (!c_list_first(&m->pending_devices)) {
+                its.it_value.tv_sec = m->coalesce_usec / 1000000;
+                its.it_value.tv_nsec = (m->coalesce_usec % 1000000) * 1000;
+                if (timerfd_settime(m->fd_timer, 0, &its, NULL) < 0)
+                        return -errno;
+        }
+
+        device->pending = true;
+        c_list_append(&m->pending_devices, &device->pending_le);
+        m->metrics.n_coalesce_deferred++;
+
+        return 0;
+}
+
+/* The coalescing window ended, run the side effects of the devices which
+ * are still around, then catch up with the subscriptions. */
+static int manager_flush_pending(Manager *m) {
+        CListEntry *le;
+        uint64_t expirations;
+        int r;
+
+        if (read(m->fd_timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                return -errno;
+
+        m->metrics.n_coalesce_windows++;
+
+        while ((le = c_list_first(&m->pending_devices))) {
+                struct device *device = c_container_of(le, struct device, pending_le);
+
+                c_list_remove(&m->pending_devices, le);
+                device->pending = false;
+
+                r = manager_device_added(m, device);
+                if (r < 0)
+                        kmsg(LOG_WARNING, "Failed to set up device: %s\n", strerror(-r));
+
+                /* The device is published in its current state. */
+                manager_queue_device(m, device, UEVENT_ACTION_ADD, m->seqnum_last);
+                m->snapshot_dirty = true;
+        }
+
+        r = manager_dispatch(m, m->seqnum_last);
+        if (r < 0)
+                return r;
+
+        return manager_dispatch_idle(m);
+}
+
+static int resync_cb(const char *devpath, const char *subsystem,
+                     const char *devtype, const char *devname,
+                     const char *modalias, void *userdata) {
+        Manager *m = userdata;
+        struct device *device;
+        int r;
+
+        device = device_get_by_devpath(m, devpath);
+        if (device) {
+                device->generation = m->generation;
+                return 0;
+        }
+
+        r = device_add(m, &device, devpath, subsystem, devtype, devname, modalias);
+        if (r <= 0)
+                return r;
+
+        /* Subscribers see the difference of a resync as events at its seqnum. */
+        manager_queue_device(m, device, UEVENT_ACTION_ADD, m->seqnum_resync);
+
+        /* We missed the ADD event of the device. */
+        if (m->settled) {
+                r = manager_device_added(m, device);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+/* Uevents were lost; enumerate /sys again, add the new devices, drop the
+ * ones which are gone, and ignore all queued events which happened before
+ * the enumeration. The subscribers get an ADD or REMOVE event for every
+ * device which changed. */
+static int manager_resync(Manager *m) {
+        uint64_t seqnum;
+        size_t n_removed = 0;
+        struct device *device, *next;
+        int r;
+
+        r = sysfs_get_seqnum(m->sysfd, &seqnum);
+        if (r < 0)
+                return r;
+
+        kmsg(LOG_WARNING, "Lost uevents, resynchronizing devices with /sys at seqnum %" PRIu64 ".", seqnum);
+
+        m->seqnum_resync = seqnum;
+        m->generation++;
+        r = sysfs_enumerate_parallel(m->sysfd, resync_cb, m);
+        if (r < 0)
+                return r;
+
+        for (device = device_first(m); device; device = next) {
+                next = device_next(device);
+                if (device->generation == m->generation)
+                        continue;
+
+                manager_queue_device(m, device, UEVENT_ACTION_REMOVE, m->seqnum_resync);
+                device_unlink(device);
+                device_free(device);
+                n_removed++;
+        }
+
+        if (n_removed > 0)
+                kmsg(LOG_INFO, "Removed %zu devices which disappeared.", n_removed);
+
+        m->metrics.n_resyncs++;
+
+        /* Lost events are not counted as filtered. */
+        if (seqnum > m->seqnum_last)
+                m->seqnum_last = seqnum;
+
+        return manager_dispatch(m, seqnum);
+}
+
 static int manager_handle_uevent(Manager *m) {
         struct device *device;
         uint64_t seqnum;
         int r, action;
 
         r = uevent_receive(m, &device, &action, &seqnum);
+        if (r == -ENOBUFS)
+                return manager_resync(m);
         if (r <= 0)
                 return r;
 
         if (m->settled && action == UEVENT_ACTION_ADD) {
-                if (device->devname) {
-                        r = permissions_apply(m->devfd, device);
-                        if (r < 0)
-                                return r;
-                }
-
-                if (device->modalias) {
-                        r = module_load(m, device->modalias);
-                        if (r < 0)
-                                return r;
-                }
-        }
-
-        r = uevent_subscriptions_dispatch(&m->uevent_subscriptions, seqnum);
+                if (m->coalesce_usec > 0)
+                        r = manager_defer(m, device);
+                else
+                        r = manager_device_added(m, device);
+                if (r < 0)
+                        return r;
+        } else if (device && device->pending)
+                m->metrics.n_coalesce_merged++;
+
+        r = manager_dispatch(m, seqnum);
         if (r < 0)
                 return r;
 
         return 0;
 }
 
+/* Publish the device tree and send the queued events after a batch of
+ * uevents. */
+static void manager_publish(Manager *m) {
+        int r;
+
+        if (m->settled && m->snapshot_dirty) {
+                /* On failure the tree stays dirty, it is retried with the next batch. */
+                r = snapshot_write(m, BUS1_DEVICES_SNAPSHOT_FILE);
+                if (r < 0)
+                        kmsg(LOG_WARNING, "Unable to write %s: %s.", BUS1_DEVICES_SNAPSHOT_FILE, strerror(-r));
+        }
+
+        monitor_flush(m->monitor);
+}
+
 int manager_run(Manager *m) {
         int r;
 
-        if (c_list_first(&m->uevent_subscriptions.list)) {
-                struct pollfd pfd = {
-                        .fd = m->fd_uevent,
-                        .events = EPOLLIN,
-                };
-
-                /* If we have subscribers, check if the uevent socket is
-                 * idle before waiting. */
-                for (;;) {
-                        r = poll(&pfd, 1, 0);
-                        if (r < 0) {
-                                if (errno == EINTR)
-                                        continue;
+        r = manager_dispatch_idle(m);
+        if (r < 0)
+                return r;
 
-                                return -errno;
-                        } else
-                                break;
-                }
+        manager_publish(m);
 
-                if (pfd.revents & EPOLLIN) {
-                        /* Pending uevents, so only dispatch subscriptions from
-                         * before any uevents were queued. */
-                        r = uevent_subscriptions_dispatch_idle(&m->uevent_subscriptions);
-                        if (r < 0)
-                                return r;
-                } else {
-                        /* No pending uevents, the next one is
-                         * guaranteed to be higher than all
-                         * subscriptions, so dispatch all now */
-                        r = uevent_subscriptions_dispatch_all(&m->uevent_subscriptions);
+        for (;;) {
+                struct epoll_event events[8];
+                int n;
+
+                /* The sysfd callbacks queued in the last iteration share a
+                 * single sync with /sys. */
+                r = device_sysfd_sync(m);
+                if (r < 0)
+                        kmsg(LOG_WARNING, "Failed to synchronize with /sys: %s\n", strerror(-r));
+                else if (r > 0) {
+                        r = manager_dispatch_idle(m);
                         if (r < 0)
                                 return r;
-                }
-        }
 
-        for (;;) {
-                int n;
-                struct epoll_event ev;
+                        manager_publish(m);
+                }
 
-                n = epoll_wait(m->fd_ep, &ev, 1, -1);
+                n = epoll_wait(m->fd_ep, events, C_ARRAY_SIZE(events), -1);
                 if (n < 0) {
                         if (errno == EINTR)
                                 continue;
@@ -319,8 +641,10 @@ int manager_run(Manager *m) {
                         return -errno;
                 }
 
-                if (n > 0) {
-                        if (ev.data.fd == m->fd_uevent && ev.events & EPOLLIN) {
+                for (int i = 0; i < n; i++) {
+                        struct epoll_event *ev = &events[i];
+
+                        if (ev->data.fd == m->fd_uevent && ev->events & EPOLLIN) {
                                 /* process all pending uevents */
                                 for (;;) {
                                         r = manager_handle_uevent(m);
@@ -335,12 +659,37 @@ int manager_run(Manager *m) {
                                 /* No pending uevents, the next one is
                                  * guaranteed to be higher than all
                                  * subscriptions, so dispatch all now */
-                                r = uevent_subscriptions_dispatch_all(&m->uevent_subscriptions);
+                                r = manager_dispatch(m, (uint64_t)-1);
+                                if (r < 0)
+                                        return r;
+
+                                manager_publish(m);
+                        }
+
+                        if (ev->data.fd == m->fd_timer && ev->events & EPOLLIN) {
+                                r = manager_flush_pending(m);
+                                if (r < 0)
+                                        return r;
+
+                                manager_publish(m);
+                        }
+
+                        if (m->monitor && ev->data.fd == monitor_get_fd(m->monitor) && ev->events & EPOLLIN) {
+                                r = monitor_dispatch(m->monitor);
+                                if (r < 0)
+                                        kmsg(LOG_WARNING, "Failed to handle device event subscribers: %s\n", strerror(-r));
+
+                                /* New subscribers wait for a sync with
+                                 * /sys, which is due now if no uevents
+                                 * are pending. */
+                                r = manager_dispatch_idle(m);
                                 if (r < 0)
                                         return r;
+
+                                manager_publish(m);
                         }
 
-                        if (ev.data.fd == m->fd_signal && ev.events & EPOLLIN) {
+                        if (ev->data.fd == m->fd_signal && ev->events & EPOLLIN) {
                                 struct signalfd_siginfo fdsi;
                                 ssize_t size;
 
@@ -348,8 +697,23 @@ int manager_run(Manager *m) {
                                 if (size != sizeof(struct signalfd_siginfo))
                                         continue;
 
-                                if (fdsi.ssi_signo == SIGTERM || fdsi.ssi_signo == SIGINT)
+                                if (fdsi.ssi_signo == SIGUSR1) {
+                                        r = metrics_write(m, METRICS_FILE);
+                                        if (r < 0)
+                                                kmsg(LOG_WARNING, "Unable to write %s: %s.", METRICS_FILE, strerror(-r));
+
+                                        continue;
+                                }
+
+                                if (fdsi.ssi_signo == SIGTERM || fdsi.ssi_signo == SIGINT) {
+                                        metrics_log(m);
+
+                                        r = module_save_cache(m);
+                                        if (r < 0)
+                                                kmsg(LOG_WARNING, "Unable to save modalias cache: %s.", strerror(-r));
+
                                         return 0;
+                                }
                         }
                 }
         }
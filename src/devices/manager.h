@@ -21,12 +21,24 @@
 #include <pthread.h>
 #include <sys/epoll.h>
 
+#include "arena.h"
+#include "intern.h"
+#include "metrics.h"
 #include "uevent.h"
 
+/* Hotplug events for the same device within this window are merged before
+ * the permissions are adjusted and the modules loaded. */
+#define MANAGER_COALESCE_USEC (10 * 1000)
+
+/* Default number of cached device directory fds, can be changed with
+ * org.bus1.devices.sysfds= on the kernel command line. */
+#define MANAGER_SYSFDS_MAX 256
+
 typedef struct Manager {
         FILE *log;
         int fd_uevent;
         int fd_signal;
+        int fd_timer;                   /* Ends the coalescing window. */
         int fd_ep;
         int devicesfd;
         int sysbusfd;
@@ -35,16 +47,36 @@ typedef struct Manager {
         int devfd;
         struct uevent_subscriptions uevent_subscriptions;
         struct uevent_subscription subscription_settle;
+        struct uevent_ring uevent_ring;
         bool settled;
-        CRBTree devices;
+        unsigned int generation;
+        uint64_t seqnum_resync;
+        uint64_t seqnum_last;           /* Highest seqnum received. */
+        bool snapshot_dirty;            /* The device tree changed since the last snapshot. */
+        uint64_t snapshot_generation;
+        struct metrics metrics;
+        CRBTree devices;                /* Top-level device nodes. */
+        Arena *arena;                   /* The objects of the device tree. */
+        Intern *components;             /* Devpath components. */
+        Intern *properties;             /* Subsystem, devtype and modalias values. */
         CRBTree subsystems;
-        pthread_mutex_t worker_lock;
-        CList work_items;
-        size_t n_workers;
+        struct Permissions *permissions;
+        struct Monitor *monitor;        /* Local subscribers to device events. */
+        CList pending_devices;          /* Added devices, side effects deferred. */
+        uint64_t coalesce_usec;
+        CList sysfds;                   /* Devices with an open sysfd, least recently used first. */
+        size_t n_sysfds;
+        size_t max_sysfds;
+        CList sysfd_queue;              /* Devices with callbacks, ordered by batch. */
+        uint64_t sysfd_batch;           /* The batch new callbacks are added to. */
+        bool sysfd_syncing;             /* The previous batch waits for sysfd_subscription. */
+        struct uevent_subscription sysfd_subscription;
+        struct module_pool *module_pool;
         size_t max_workers;
 } Manager;
 
 Manager *manager_free(Manager *m);
+int manager_new_at(Manager **manager, int sysfd);
 int manager_new(Manager **manager);
 
 int manager_enumerate(Manager *manager);
@@ -0,0 +1,193 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "device.h"
+#include "metrics.h"
+#include "module.h"
+#include "monitor.h"
+#include "shared/kmsg.h"
+
+uint64_t metrics_now_nsec(void) {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_histogram_add(struct metrics_histogram *histogram, uint64_t value) {
+        unsigned int bucket;
+        uint64_t max;
+
+        bucket = value > 0 ? 64 - __builtin_clzll(value) : 0;
+        bucket = c_min(bucket, METRICS_HISTOGRAM_BUCKETS - 1U);
+
+        __atomic_add_fetch(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&histogram->n_values, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&histogram->sum, value, __ATOMIC_RELAXED);
+
+        max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+        while (value > max)
+                if (__atomic_compare_exchange_n(&histogram->max, &max, value, true,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                        break;
+}
+
+/* The upper bound of the bucket which contains the percentile, or the
+ * maximum if that is lower. */
+static uint64_t metrics_histogram_percentile(struct metrics_histogram *histogram, unsigned int percent) {
+        uint64_t n_values, n = 0;
+
+        n_values = __atomic_load_n(&histogram->n_values, __ATOMIC_RELAXED);
+        if (n_values == 0)
+                return 0;
+
+        for (unsigned int i = 0; i < METRICS_HISTOGRAM_BUCKETS - 1; i++) {
+                n += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+                if (n * 100 >= n_values * percent)
+                        return c_min(1ULL << i, (unsigned long long)__atomic_load_n(&histogram->max, __ATOMIC_RELAXED));
+        }
+
+        return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+void metrics_histogram_write(FILE *f, const char *name, struct metrics_histogram *histogram) {
+        fprintf(f, "%s_count %" PRIu64 "\n", name, __atomic_load_n(&histogram->n_values, __ATOMIC_RELAXED));
+        fprintf(f, "%s_sum %" PRIu64 "\n", name, __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED));
+        fprintf(f, "%s_max %" PRIu64 "\n", name, __atomic_load_n(&histogram->max, __ATOMIC_RELAXED));
+        fprintf(f, "%s_p50 %" PRIu64 "\n", name, metrics_histogram_percentile(histogram, 50));
+        fprintf(f, "%s_p99 %" PRIu64 "\n", name, metrics_histogram_percentile(histogram, 99));
+
+        for (unsigned int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) {
+                uint64_t n = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+
+                if (n == 0)
+                        continue;
+
+                if (i < METRICS_HISTOGRAM_BUCKETS - 1)
+                        fprintf(f, "%s_bucket_lt_%llu %" PRIu64 "\n", name, 1ULL << i, n);
+                else
+                        fprintf(f, "%s_bucket_inf %" PRIu64 "\n", name, n);
+        }
+}
+
+void metrics_log(Manager *m) {
+        kmsg(LOG_INFO, "Received %" PRIu64 " uevents, %" PRIu64 " were filtered by the kernel, %u resyncs.",
+             m->metrics.n_uevents, m->metrics.n_uevents_filtered, m->metrics.n_resyncs);
+        module_log_stats(m);
+}
+
+static void metrics_write_devices(Manager *m, FILE *f) {
+        size_t n_devices = 0, n_devtypes = 0, n_subsystems = 0;
+
+        for (struct device *device = device_first(m); device; device = device_next(device))
+                n_devices++;
+
+        for (CRBNode *n = c_rbtree_first(&m->subsystems); n; n = c_rbnode_next(n)) {
+                struct subsystem *subsystem = c_container_of(n, struct subsystem, rb);
+
+                n_subsystems++;
+                for (CRBNode *d = c_rbtree_first(&subsystem->devtypes); d; d = c_rbnode_next(d))
+                        n_devtypes++;
+
+                fprintf(f, "uevents_subsystem_%s %" PRIu64 "\n", subsystem->name, subsystem->n_uevents);
+        }
+
+        fprintf(f, "devices %zu\n", n_devices);
+        fprintf(f, "subsystems %zu\n", n_subsystems);
+        fprintf(f, "devtypes %zu\n", n_devtypes);
+        fprintf(f, "coldplug_usec %" PRIu64 "\n", m->metrics.coldplug_usec);
+        fprintf(f, "snapshot_generation %" PRIu64 "\n", m->snapshot_generation);
+        metrics_histogram_write(f, "snapshot_nsec", &m->metrics.snapshot_nsec);
+        fprintf(f, "sysfds %zu\n", m->n_sysfds);
+        fprintf(f, "sysfds_max %zu\n", m->max_sysfds);
+        fprintf(f, "sysfd_batches %" PRIu64 "\n", m->metrics.n_sysfd_batches);
+        fprintf(f, "sysfd_hits %" PRIu64 "\n", m->metrics.n_sysfd_hits);
+        fprintf(f, "sysfd_opens %" PRIu64 "\n", m->metrics.n_sysfd_opens);
+        fprintf(f, "sysfd_evictions %" PRIu64 "\n", m->metrics.n_sysfd_evictions);
+
+        arena_write_stats(m->arena, f);
+}
+
+static void metrics_write_uevents(Manager *m, FILE *f) {
+        fprintf(f, "uevents %" PRIu64 "\n", m->metrics.n_uevents);
+        fprintf(f, "uevents_filtered %" PRIu64 "\n", m->metrics.n_uevents_filtered);
+        fprintf(f, "uevents_failed %" PRIu64 "\n", m->metrics.n_uevents_failed);
+        fprintf(f, "uevents_ignored %" PRIu64 "\n", m->metrics.n_uevents_ignored);
+        fprintf(f, "uevent_resyncs %u\n", m->metrics.n_resyncs);
+
+        for (int i = 0; i < _UEVENT_ACTION_N; i++)
+                fprintf(f, "uevents_action_%s %" PRIu64 "\n", uevent_action_to_string(i), m->metrics.n_uevents_action[i]);
+
+        metrics_histogram_write(f, "uevent_nsec", &m->metrics.uevent_nsec);
+
+        fprintf(f, "coalesce_windows %" PRIu64 "\n", m->metrics.n_coalesce_windows);
+        fprintf(f, "coalesce_deferred %" PRIu64 "\n", m->metrics.n_coalesce_deferred);
+        fprintf(f, "coalesce_merged %" PRIu64 "\n", m->metrics.n_coalesce_merged);
+        fprintf(f, "coalesce_dropped %" PRIu64 "\n", m->metrics.n_coalesce_dropped);
+}
+
+/* A plain "name value" list, the file is replaced atomically. */
+int metrics_write(Manager *m, const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        _c_cleanup_(c_freep) char *dir = NULL;
+        _c_cleanup_(c_freep) char *tmp = NULL;
+        char *s;
+        int r;
+
+        dir = strdup(file);
+        if (!dir)
+                return -ENOMEM;
+
+        s = strrchr(dir, '/');
+        if (s && s != dir) {
+                *s = '\0';
+                if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+                        return -errno;
+        }
+
+        if (asprintf(&tmp, "%s.tmp", file) < 0)
+                return -ENOMEM;
+
+        f = fopen(tmp, "we");
+        if (!f)
+                return -errno;
+
+        metrics_write_uevents(m, f);
+        metrics_write_devices(m, f);
+        module_write_stats(m, f);
+        monitor_write_stats(m->monitor, f);
+
+        if (fflush(f) != 0) {
+                r = -errno;
+                unlink(tmp);
+                return r;
+        }
+
+        if (rename(tmp, file) < 0) {
+                r = -errno;
+                unlink(tmp);
+                return r;
+        }
+
+        return 0;
+}
@@ -0,0 +1,70 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <stdio.h>
+#include "uevent.h"
+
+/* Written on SIGUSR1. */
+#define METRICS_FILE "/run/org.bus1.devices/stats"
+
+#define METRICS_HISTOGRAM_BUCKETS 32
+
+/* Bucket i counts the values below 2^i, the last one all larger values.
+ * Updated with relaxed atomics, it can be shared between threads. */
+struct metrics_histogram {
+        uint64_t buckets[METRICS_HISTOGRAM_BUCKETS];
+        uint64_t n_values;
+        uint64_t sum;
+        uint64_t max;
+};
+
+/* Counters of the main thread. */
+struct metrics {
+        uint64_t n_uevents;                     /* Received from the kernel. */
+        uint64_t n_uevents_filtered;            /* Seqnums never received. */
+        uint64_t n_uevents_failed;              /* Failed to parse or apply. */
+        uint64_t n_uevents_ignored;             /* No device, or covered by a resync. */
+        uint64_t n_uevents_action[_UEVENT_ACTION_N];
+        unsigned int n_resyncs;
+        struct metrics_histogram uevent_nsec;   /* Parsing and updating the tree. */
+
+        uint64_t n_coalesce_windows;            /* Expired coalescing windows. */
+        uint64_t n_coalesce_deferred;           /* Devices with deferred side effects. */
+        uint64_t n_coalesce_merged;             /* Events for a device with deferred side effects. */
+        uint64_t n_coalesce_dropped;            /* Removed before the side effects were run. */
+
+        uint64_t n_sysfd_batches;               /* Sysfs syncs for device_call_with_sysfd(). */
+        uint64_t n_sysfd_hits;                  /* Callbacks served from the sysfd cache. */
+        uint64_t n_sysfd_opens;
+        uint64_t n_sysfd_evictions;             /* Closed to stay within the budget. */
+
+        struct metrics_histogram snapshot_nsec; /* Writing the device snapshot. */
+
+        uint64_t coldplug_begin_usec;
+        uint64_t coldplug_usec;
+};
+
+uint64_t metrics_now_nsec(void);
+
+void metrics_histogram_add(struct metrics_histogram *histogram, uint64_t value);
+void metrics_histogram_write(FILE *f, const char *name, struct metrics_histogram *histogram);
+
+void metrics_log(Manager *m);
+int metrics_write(Manager *m, const char *file);
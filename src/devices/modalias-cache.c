@@ -0,0 +1,342 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <c-rbtree.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include "shared/crc32.h"
+#include "shared/kmsg.h"
+#include "modalias-cache.h"
+
+/* The file is only valid for the kernel and the module index it was
+ * created with. It is followed by n_entries offsets of the strings,
+ * sorted by the strings, and the NUL terminated strings. */
+struct modalias_cache_header {
+        char signature[8];
+        char release[65];
+        uint8_t padding[3];
+        uint32_t index_crc;
+        uint32_t n_entries;
+        uint32_t n_strings;
+};
+
+struct modalias {
+        CRBNode rb;
+        char name[];
+};
+
+struct ModaliasCache {
+        char *file;
+        struct modalias_cache_header key;
+
+        /* Read-only mapping of the file of an earlier boot. */
+        void *map;
+        size_t n_map;
+        const uint32_t *offsets;
+        const char *strings;
+        uint32_t n_entries;
+
+        /* Added during this boot. */
+        pthread_mutex_t lock;
+        CRBTree modaliases;
+        size_t n_modaliases;
+};
+
+static int modalias_cache_key(struct modalias_cache_header *key) {
+        _c_cleanup_(c_freep) char *index = NULL;
+        _c_cleanup_(c_closep) int fd = -1;
+        struct utsname u;
+        uint8_t buf[64 * 1024];
+        uint32_t crc = 0;
+        ssize_t len;
+
+        if (uname(&u) < 0)
+                return -errno;
+
+        if (asprintf(&index, "/lib/modules/%s/modules.alias.bin", u.release) < 0)
+                return -ENOMEM;
+
+        fd = open(index, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        while ((len = read(fd, buf, sizeof(buf))) > 0)
+                crc = crc32_update(crc, buf, len);
+        if (len < 0)
+                return -errno;
+
+        memcpy(key->signature, "B1MODAL", sizeof(key->signature));
+        strncpy(key->release, u.release, sizeof(key->release) - 1);
+        key->index_crc = crc;
+
+        return 0;
+}
+
+static int modalias_cache_map(ModaliasCache *cache) {
+        _c_cleanup_(c_closep) int fd = -1;
+        const struct modalias_cache_header *header;
+        struct stat st;
+        void *map;
+
+        fd = open(cache->file, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if ((size_t)st.st_size < sizeof(*header))
+                return -EINVAL;
+
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+                return -errno;
+
+        header = map;
+        if (memcmp(header, &cache->key, offsetof(struct modalias_cache_header, n_entries)) != 0 ||
+            sizeof(*header) + header->n_entries * sizeof(uint32_t) + header->n_strings != (size_t)st.st_size) {
+                munmap(map, st.st_size);
+                return -ESTALE;
+        }
+
+        cache->map = map;
+        cache->n_map = st.st_size;
+        cache->n_entries = header->n_entries;
+        cache->offsets = (const uint32_t *)(header + 1);
+        cache->strings = (const char *)(cache->offsets + header->n_entries);
+
+        for (uint32_t i = 0; i < cache->n_entries; i++) {
+                if (cache->offsets[i] >= header->n_strings ||
+                    !memchr(cache->strings + cache->offsets[i], '\0', header->n_strings - cache->offsets[i])) {
+                        munmap(map, st.st_size);
+                        cache->map = NULL;
+                        cache->n_entries = 0;
+                        return -EINVAL;
+                }
+        }
+
+        return 0;
+}
+
+ModaliasCache *modalias_cache_free(ModaliasCache *cache) {
+        CRBNode *n;
+
+        if (!cache)
+                return NULL;
+
+        while ((n = c_rbtree_first(&cache->modaliases))) {
+                c_rbtree_remove(&cache->modaliases, n);
+                free(c_container_of(n, struct modalias, rb));
+        }
+
+        if (cache->map)
+                munmap(cache->map, cache->n_map);
+
+        pthread_mutex_destroy(&cache->lock);
+        free(cache->file);
+        free(cache);
+
+        return NULL;
+}
+
+/* A missing or outdated file results in an empty cache. */
+int modalias_cache_new(ModaliasCache **cachep, const char *file) {
+        _c_cleanup_(modalias_cache_freep) ModaliasCache *cache = NULL;
+        int r;
+
+        cache = calloc(1, sizeof(ModaliasCache));
+        if (!cache)
+                return -ENOMEM;
+
+        pthread_mutex_init(&cache->lock, NULL);
+
+        cache->file = strdup(file);
+        if (!cache->file)
+                return -ENOMEM;
+
+        r = modalias_cache_key(&cache->key);
+        if (r < 0)
+                return r;
+
+        r = modalias_cache_map(cache);
+        if (r < 0 && r != -ENOENT)
+                kmsg(LOG_INFO, "Discarding modalias cache %s: %s.", file, strerror(-r));
+
+        *cachep = cache;
+        cache = NULL;
+
+        return 0;
+}
+
+/* Only looks at the entries of earlier boots, the mapping is never
+ * modified and needs no lock. */
+bool modalias_cache_contains(ModaliasCache *cache, const char *modalias) {
+        uint32_t l = 0, r = cache->n_entries;
+
+        while (l < r) {
+                uint32_t m = l + (r - l) / 2;
+                int k;
+
+                k = strcmp(modalias, cache->strings + cache->offsets[m]);
+                if (k == 0)
+                        return true;
+
+                if (k < 0)
+                        r = m;
+                else
+                        l = m + 1;
+        }
+
+        return false;
+}
+
+static int modaliases_compare(CRBTree *t, void *k, CRBNode *n) {
+        struct modalias *modalias = c_container_of(n, struct modalias, rb);
+        const char *name = k;
+
+        return strcmp(name, modalias->name);
+}
+
+int modalias_cache_add(ModaliasCache *cache, const char *name) {
+        struct modalias *modalias;
+        CRBNode **slot, *p;
+        size_t n_name;
+
+        if (modalias_cache_contains(cache, name))
+                return 0;
+
+        n_name = strlen(name) + 1;
+
+        pthread_mutex_lock(&cache->lock);
+        slot = c_rbtree_find_slot(&cache->modaliases, modaliases_compare, name, &p);
+        if (slot) {
+                modalias = malloc(sizeof(*modalias) + n_name);
+                if (!modalias) {
+                        pthread_mutex_unlock(&cache->lock);
+                        return -ENOMEM;
+                }
+
+                modalias->rb = (CRBNode){};
+                memcpy(modalias->name, name, n_name);
+                c_rbtree_add(&cache->modaliases, p, slot, &modalias->rb);
+                cache->n_modaliases++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        return 0;
+}
+
+static int modalias_cache_write(ModaliasCache *cache, FILE *f) {
+        struct modalias_cache_header header = cache->key;
+        CRBNode *n;
+        uint32_t i = 0;
+        uint32_t offset = 0;
+
+        header.n_entries = cache->n_entries + cache->n_modaliases;
+        header.n_strings = 0;
+
+        for (uint32_t k = 0; k < cache->n_entries; k++)
+                header.n_strings += strlen(cache->strings + cache->offsets[k]) + 1;
+        for (n = c_rbtree_first(&cache->modaliases); n; n = c_rbnode_next(n))
+                header.n_strings += strlen(c_container_of(n, struct modalias, rb)->name) + 1;
+
+        if (fwrite(&header, sizeof(header), 1, f) != 1)
+                return -EIO;
+
+        /* Merge the sorted mapping with the sorted tree, twice; first the
+         * offsets, then the strings. */
+        for (unsigned int pass = 0; pass < 2; pass++) {
+                n = c_rbtree_first(&cache->modaliases);
+                i = 0;
+
+                while (i < cache->n_entries || n) {
+                        const char *s;
+                        size_t n_s;
+
+                        if (!n || (i < cache->n_entries &&
+                                   strcmp(cache->strings + cache->offsets[i], c_container_of(n, struct modalias, rb)->name) < 0)) {
+                                s = cache->strings + cache->offsets[i];
+                                i++;
+                        } else {
+                                s = c_container_of(n, struct modalias, rb)->name;
+                                n = c_rbnode_next(n);
+                        }
+
+                        n_s = strlen(s) + 1;
+
+                        if (pass == 0) {
+                                if (fwrite(&offset, sizeof(offset), 1, f) != 1)
+                                        return -EIO;
+
+                                offset += n_s;
+                        } else if (fwrite(s, n_s, 1, f) != 1)
+                                return -EIO;
+                }
+        }
+
+        if (fflush(f) != 0)
+                return -errno;
+
+        return 0;
+}
+
+/* Write the entries of the earlier boots together with the new ones,
+ * the file is replaced atomically. */
+int modalias_cache_save(ModaliasCache *cache) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        _c_cleanup_(c_freep) char *tmp = NULL;
+        int r;
+
+        pthread_mutex_lock(&cache->lock);
+
+        if (cache->n_modaliases == 0) {
+                pthread_mutex_unlock(&cache->lock);
+                return 0;
+        }
+
+        if (asprintf(&tmp, "%s.tmp", cache->file) < 0) {
+                pthread_mutex_unlock(&cache->lock);
+                return -ENOMEM;
+        }
+
+        f = fopen(tmp, "we");
+        if (!f) {
+                r = -errno;
+                pthread_mutex_unlock(&cache->lock);
+                return r;
+        }
+
+        r = modalias_cache_write(cache, f);
+        pthread_mutex_unlock(&cache->lock);
+        if (r < 0) {
+                unlink(tmp);
+                return r;
+        }
+
+        if (rename(tmp, cache->file) < 0) {
+                r = -errno;
+                unlink(tmp);
+                return r;
+        }
+
+        return 0;
+}
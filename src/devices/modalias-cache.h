@@ -0,0 +1,32 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* Modaliases which did not resolve to a loadable module, stored in the
+ * data directory of the service. */
+#define MODALIAS_CACHE_FILE "/var/modalias.cache"
+
+typedef struct ModaliasCache ModaliasCache;
+
+ModaliasCache *modalias_cache_free(ModaliasCache *cache);
+int modalias_cache_new(ModaliasCache **cachep, const char *file);
+
+bool modalias_cache_contains(ModaliasCache *cache, const char *modalias);
+int modalias_cache_add(ModaliasCache *cache, const char *modalias);
+int modalias_cache_save(ModaliasCache *cache);
+
+C_DEFINE_CLEANUP(ModaliasCache *, modalias_cache_free);
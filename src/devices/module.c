@@ -16,30 +16,148 @@
 ***/
 
 #include <c-macro.h>
+#include <c-usec.h>
+#include <fnmatch.h>
 #include <libkmod.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <string.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
+#include "shared/kmsg.h"
+#include "metrics.h"
+#include "modalias-cache.h"
 #include "module.h"
 
+/* Must be a power of two. */
+#define MODULE_QUEUE_SIZE 4096
+
+/* A modalias is queued only once while its work item is pending. Finished
+ * items are forgotten, the next event of a failed or unloaded module
+ * probes it again. */
 struct work_item {
-        CListEntry le;
+        CRBNode rb;
+        CListEntry le;                  /* In the overflow list of its class. */
+        struct work_item *next_done;
         const char *modalias;
+        unsigned int class;
+        uint64_t queued_usec;
 };
 
-struct work_item *work_item_free(struct work_item *work_item) {
-        if (!work_item)
-                return NULL;
+/* Modules which are built into the kernel; loaded modules can be removed
+ * again, they are always checked in /sys/module. */
+struct module_name {
+        CRBNode rb;
+        char name[];
+};
+
+struct module_cell {
+        size_t sequence;
+        struct work_item *work_item;
+};
+
+/* Bounded lock-free multi-producer multi-consumer queue; every cell
+ * carries a sequence number which tells if it can be written or read in
+ * the current round (D. Vyukov). */
+struct module_queue {
+        struct module_cell cells[MODULE_QUEUE_SIZE];
+        size_t head __attribute__((__aligned__(64)));
+        size_t tail __attribute__((__aligned__(64)));
+};
+
+/* Threads waiting for a condition sleep on the epoch, it is bumped by the
+ * waker. */
+struct module_park {
+        uint32_t epoch;
+        uint32_t n_waiters;
+};
+
+struct module_pool {
+        struct module_queue queues[_MODULE_CLASS_N];
+        struct module_park park_work;   /* Idle workers. */
+        bool stop;
+
+        /* Items which did not fit into a full queue, moved to the queue by
+         * the workers when they make room. The producer never waits. */
+        pthread_mutex_t overflow_lock;
+        CList overflow[_MODULE_CLASS_N];
+        size_t n_overflow[_MODULE_CLASS_N];
+
+        pthread_t *threads;
+        size_t n_threads;
+
+        CRBTree work_items;             /* Only accessed by the producer. */
+        struct work_item *done;         /* Finished, to be removed by the producer. */
+        ModaliasCache *modalias_cache;  /* Modaliases without a module. */
+
+        pthread_mutex_t modules_lock;
+        CRBTree modules;
+
+        uint64_t n_modaliases;
+        uint64_t n_modalias_hits;       /* Duplicate modaliases not queued. */
+        uint64_t n_modalias_cache_hits; /* Known to have no module. */
+        uint64_t n_module_hits;         /* Modules found in the cache. */
+        uint64_t n_modules_present;     /* Modules found in /sys/module. */
+        uint64_t n_modules_loaded;
+        uint64_t n_queued;              /* Current depth of all queues. */
+        uint64_t max_queued;
+        uint64_t n_overflowed;          /* Pushed to a full queue. */
+
+        struct metrics_histogram queued_usec[_MODULE_CLASS_N];  /* Until the end of the probe. */
+        struct metrics_histogram resolve_usec;                  /* Lookup and probe. */
+};
+
+/* Drivers of the devices the boot waits for are loaded first. */
+static const struct module_class {
+        const char *subsystem;
+        const char *modalias;
+        unsigned int class;
+} module_classes[] = {
+        { "pci",        "pci:*bc01sc*",                 MODULE_CLASS_STORAGE },
+        { "virtio",     "virtio:d00000002v*",           MODULE_CLASS_STORAGE },
+        { "virtio",     "virtio:d00000008v*",           MODULE_CLASS_STORAGE },
+        { "scsi",       "scsi:t-0x00*",                 MODULE_CLASS_STORAGE },
+        { "nvme",       NULL,                           MODULE_CLASS_STORAGE },
+        { "mmc",        "mmc:block",                    MODULE_CLASS_STORAGE },
+        { "usb",        "usb:*ic08isc*",                MODULE_CLASS_STORAGE },
+        { "pci",        "pci:*bc0Csc03*",               MODULE_CLASS_BUS },
+        { "pci",        "pci:*bc06sc*",                 MODULE_CLASS_BUS },
+};
+
+static const char *module_class_names[] = {
+        [MODULE_CLASS_STORAGE] = "storage",
+        [MODULE_CLASS_BUS] = "bus",
+        [MODULE_CLASS_DEFAULT] = "default",
+};
 
-        assert(!c_list_entry_prev(&work_item->le));
-        assert(!c_list_entry_next(&work_item->le));
+static unsigned int module_class(const char *subsystem, const char *modalias) {
+        for (size_t i = 0; i < C_ARRAY_SIZE(module_classes); i++) {
+                if (!subsystem || strcmp(subsystem, module_classes[i].subsystem) != 0)
+                        continue;
 
+                if (module_classes[i].modalias && fnmatch(module_classes[i].modalias, modalias, 0) != 0)
+                        continue;
+
+                return module_classes[i].class;
+        }
+
+        return MODULE_CLASS_DEFAULT;
+}
+
+static struct work_item *work_item_free(struct work_item *work_item) {
         free(work_item);
 
         return NULL;
 }
 
-static int work_item_new(struct work_item **work_itemp, const char *modalias) {
+static int work_items_compare(CRBTree *t, void *k, CRBNode *n) {
+        struct work_item *work_item = c_container_of(n, struct work_item, rb);
+        const char *modalias = k;
+
+        return strcmp(modalias, work_item->modalias);
+}
+
+static int work_item_new(struct work_item **work_itemp, const char *modalias, unsigned int class) {
         struct work_item *work_item;
         size_t n_modalias;
 
@@ -47,49 +165,204 @@ static int work_item_new(struct work_item **work_itemp, const char *modalias) {
         work_item = malloc(sizeof(*work_item) + n_modalias);
         if (!work_item)
                 return -ENOMEM;
-        work_item->modalias = memcpy((void*)(work_item + 1), modalias, n_modalias);
-
+        work_item->rb = (CRBNode){};
         c_list_entry_init(&work_item->le);
+        work_item->next_done = NULL;
+        work_item->modalias = memcpy((void*)(work_item + 1), modalias, n_modalias);
+        work_item->class = class;
 
         *work_itemp = work_item;
 
         return 0;
 }
 
-struct work_item *work_item_pop(Manager *m) {
-        CListEntry *first;
+static void module_queue_init(struct module_queue *queue) {
+        for (size_t i = 0; i < MODULE_QUEUE_SIZE; i++)
+                queue->cells[i].sequence = i;
 
-        assert(m);
+        queue->head = 0;
+        queue->tail = 0;
+}
 
-        first = c_list_first(&m->work_items);
-        if (!first)
-                return NULL;
+static bool module_queue_push(struct module_queue *queue, struct work_item *work_item) {
+        size_t pos;
+
+        pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        for (;;) {
+                struct module_cell *cell = &queue->cells[pos & (MODULE_QUEUE_SIZE - 1)];
+                intptr_t diff;
+
+                diff = (intptr_t)__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, true,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                                cell->work_item = work_item;
+                                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                                return true;
+                        }
+                } else if (diff < 0)
+                        return false;
+                else
+                        pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+}
+
+static struct work_item *module_queue_pop(struct module_queue *queue) {
+        size_t pos;
 
-        c_list_remove(&m->work_items, first);
+        pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        for (;;) {
+                struct module_cell *cell = &queue->cells[pos & (MODULE_QUEUE_SIZE - 1)];
+                intptr_t diff;
 
-        return c_container_of(first, struct work_item, le);
+                diff = (intptr_t)__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, true,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                                struct work_item *work_item = cell->work_item;
+
+                                __atomic_store_n(&cell->sequence, pos + MODULE_QUEUE_SIZE, __ATOMIC_RELEASE);
+                                return work_item;
+                        }
+                } else if (diff < 0)
+                        return NULL;
+                else
+                        pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
 }
 
-static void work_item_push(Manager *m, struct work_item *work_item) {
-        assert(m);
+static uint32_t module_park_prepare(struct module_park *park) {
+        uint32_t epoch;
 
-        if (!work_item)
-                return;
+        epoch = __atomic_load_n(&park->epoch, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&park->n_waiters, 1, __ATOMIC_SEQ_CST);
 
-        c_list_append(&m->work_items, &work_item->le);
+        return epoch;
 }
 
-static void module_log(void *data, int priority, const char *file, int line, const char *fn, const char *format, va_list args) {}
+static void module_park_wait(struct module_park *park, uint32_t epoch) {
+        /* Returns immediately if the epoch was bumped in the meantime. */
+        syscall(__NR_futex, &park->epoch, FUTEX_WAIT_PRIVATE, epoch, NULL, NULL, 0);
+        __atomic_sub_fetch(&park->n_waiters, 1, __ATOMIC_SEQ_CST);
+}
 
-static void *module_thread(void *p) {
-        Manager *m = p;
-        struct kmod_ctx *ctx;
+static void module_park_cancel(struct module_park *park) {
+        __atomic_sub_fetch(&park->n_waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static void module_park_wake(struct module_park *park, int n) {
+        /* Pairs with the n_waiters increment before the waiter checks its
+         * condition again. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&park->n_waiters, __ATOMIC_SEQ_CST) == 0)
+                return;
+
+        __atomic_add_fetch(&park->epoch, 1, __ATOMIC_RELEASE);
+        syscall(__NR_futex, &park->epoch, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Take an item from the overflow list of a class, and move the following
+ * ones to the queue as long as it has room. */
+static struct work_item *module_pool_pop_overflow(struct module_pool *pool, size_t class, bool take) {
         struct work_item *work_item = NULL;
-        int r;
+        CListEntry *le;
 
-        assert(m);
+        if (__atomic_load_n(&pool->n_overflow[class], __ATOMIC_ACQUIRE) == 0)
+                return NULL;
 
-        prctl(PR_SET_NAME, (unsigned long) "module");
+        pthread_mutex_lock(&pool->overflow_lock);
+        while ((le = c_list_first(&pool->overflow[class]))) {
+                struct work_item *item = c_container_of(le, struct work_item, le);
+
+                if (take && !work_item)
+                        work_item = item;
+                else if (!module_queue_push(&pool->queues[class], item))
+                        break;
+
+                c_list_remove(&pool->overflow[class], &item->le);
+                __atomic_sub_fetch(&pool->n_overflow[class], 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&pool->overflow_lock);
+
+        return work_item;
+}
+
+/* Higher classes are always drained first. */
+static struct work_item *module_pool_pop_class(struct module_pool *pool) {
+        struct work_item *work_item;
+
+        for (size_t i = 0; i < _MODULE_CLASS_N; i++) {
+                work_item = module_queue_pop(&pool->queues[i]);
+                if (work_item) {
+                        module_pool_pop_overflow(pool, i, false);
+                        return work_item;
+                }
+
+                work_item = module_pool_pop_overflow(pool, i, true);
+                if (work_item)
+                        return work_item;
+        }
+
+        return NULL;
+}
+
+static struct work_item *module_pool_pop(struct module_pool *pool) {
+        struct work_item *work_item;
+        uint32_t epoch;
+
+        for (;;) {
+                work_item = module_pool_pop_class(pool);
+                if (work_item)
+                        break;
+
+                if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE))
+                        return NULL;
+
+                /* Announce ourselves before looking again, a producer
+                 * either sees us or we see its item. */
+                epoch = module_park_prepare(&pool->park_work);
+
+                work_item = module_pool_pop_class(pool);
+                if (work_item) {
+                        module_park_cancel(&pool->park_work);
+                        break;
+                }
+
+                if (__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+                        module_park_cancel(&pool->park_work);
+                        return NULL;
+                }
+
+                module_park_wait(&pool->park_work, epoch);
+        }
+
+        return work_item;
+}
+
+/* Called from the event loop, it must not block on the workers. */
+static void module_pool_push(struct module_pool *pool, struct work_item *work_item) {
+        unsigned int class = work_item->class;
+
+        work_item->queued_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+        pool->max_queued = c_max(pool->max_queued, __atomic_add_fetch(&pool->n_queued, 1, __ATOMIC_RELAXED));
+
+        /* Queue behind the items which already overflowed. */
+        if (__atomic_load_n(&pool->n_overflow[class], __ATOMIC_ACQUIRE) > 0 ||
+            !module_queue_push(&pool->queues[class], work_item)) {
+                pthread_mutex_lock(&pool->overflow_lock);
+                c_list_append(&pool->overflow[class], &work_item->le);
+                __atomic_add_fetch(&pool->n_overflow[class], 1, __ATOMIC_RELEASE);
+                pthread_mutex_unlock(&pool->overflow_lock);
+                pool->n_overflowed++;
+        }
+
+        module_park_wake(&pool->park_work, 1);
+}
+
+static void module_log(void *data, int priority, const char *file, int line, const char *fn, const char *format, va_list args) {}
+
+static struct kmod_ctx *module_ctx_new(void) {
+        struct kmod_ctx *ctx;
 
         ctx = kmod_new(NULL, NULL);
         if (!ctx)
@@ -97,85 +370,334 @@ static void *module_thread(void *p) {
 
         kmod_set_log_fn(ctx, module_log, NULL);
 
-        r = kmod_load_resources(ctx);
-        if (r < 0)
-                goto finish;
+        if (kmod_load_resources(ctx) < 0)
+                return kmod_unref(ctx);
 
-        pthread_mutex_lock(&m->worker_lock);
-        work_item = work_item_pop(m);
-        if (!work_item)
-                m->n_workers --;
-        pthread_mutex_unlock(&m->worker_lock);
+        return ctx;
+}
 
-        while (work_item) {
-                struct kmod_list *list = NULL;
+static int modules_compare(CRBTree *t, void *k, CRBNode *n) {
+        struct module_name *module = c_container_of(n, struct module_name, rb);
+        const char *name = k;
 
-                r = kmod_module_new_from_lookup(ctx, work_item->modalias, &list);
-                if (r < 0 && r != -ENOSYS)
-                        goto finish;
+        return strcmp(name, module->name);
+}
 
-                if (list) {
-                        struct kmod_list *l;
+static struct module_name *module_name_find(struct module_pool *pool, const char *name) {
+        CRBNode *n;
 
-                        kmod_list_foreach(l, list) {
-                                struct kmod_module *mod;
+        pthread_mutex_lock(&pool->modules_lock);
+        n = c_rbtree_find_node(&pool->modules, modules_compare, name);
+        pthread_mutex_unlock(&pool->modules_lock);
 
-                                mod = kmod_module_get_module(l);
-                                kmod_module_probe_insert_module(mod, KMOD_PROBE_APPLY_BLACKLIST|KMOD_PROBE_IGNORE_COMMAND,
-                                                                NULL, NULL, NULL, NULL);
-                                kmod_module_unref(mod);
-                        }
+        /* Entries are never removed while the workers run. */
+        return n ? c_container_of(n, struct module_name, rb) : NULL;
+}
 
-                        kmod_module_unref_list(list);
+static void module_name_add(struct module_pool *pool, const char *name) {
+        struct module_name *module;
+        CRBNode **slot, *p;
+        size_t n_name;
+
+        pthread_mutex_lock(&pool->modules_lock);
+        slot = c_rbtree_find_slot(&pool->modules, modules_compare, name, &p);
+        if (slot) {
+                n_name = strlen(name) + 1;
+                module = malloc(sizeof(*module) + n_name);
+                if (module) {
+                        module->rb = (CRBNode){};
+                        memcpy(module->name, name, n_name);
+                        c_rbtree_add(&pool->modules, p, slot, &module->rb);
                 }
+        }
+        pthread_mutex_unlock(&pool->modules_lock);
+}
 
-                work_item_free(work_item);
-                pthread_mutex_lock(&m->worker_lock);
-                work_item = work_item_pop(m);
-                if (!work_item)
-                        m->n_workers --;
-                pthread_mutex_unlock(&m->worker_lock);
+/* Returns true if the module is built into the kernel. */
+static bool module_probe(struct module_pool *pool, struct kmod_module *mod) {
+        struct module_name *module;
+        const char *name;
+        int state;
+
+        name = kmod_module_get_name(mod);
+
+        module = module_name_find(pool, name);
+        if (module) {
+                __atomic_add_fetch(&pool->n_module_hits, 1, __ATOMIC_RELAXED);
+                return true;
+        }
+
+        /* Reads /sys/module/$NAME/initstate, or the builtin index. */
+        state = kmod_module_get_initstate(mod);
+        if (state >= 0) {
+                __atomic_add_fetch(&pool->n_modules_present, 1, __ATOMIC_RELAXED);
+                if (state == KMOD_MODULE_BUILTIN)
+                        module_name_add(pool, name);
+                return state == KMOD_MODULE_BUILTIN;
+        }
+
+        if (kmod_module_probe_insert_module(mod, KMOD_PROBE_APPLY_BLACKLIST|KMOD_PROBE_IGNORE_COMMAND,
+                                            NULL, NULL, NULL, NULL) < 0)
+                return false;
+
+        __atomic_add_fetch(&pool->n_modules_loaded, 1, __ATOMIC_RELAXED);
+
+        return false;
+}
+
+static void module_resolve(struct module_pool *pool, struct kmod_ctx *ctx, struct work_item *work_item) {
+        struct kmod_list *list = NULL;
+        int r;
+
+        r = kmod_module_new_from_lookup(ctx, work_item->modalias, &list);
+        if (r < 0 && r != -ENOSYS)
+                return;
+
+        if (list) {
+                struct kmod_list *l;
+                bool builtin = true;
+
+                kmod_list_foreach(l, list) {
+                        struct kmod_module *mod;
+
+                        mod = kmod_module_get_module(l);
+                        if (!module_probe(pool, mod))
+                                builtin = false;
+                        kmod_module_unref(mod);
+                }
+
+                kmod_module_unref_list(list);
+
+                if (!builtin)
+                        return;
+        }
+
+        /* Nothing to load, remember it for the next boot. */
+        if (pool->modalias_cache)
+                modalias_cache_add(pool->modalias_cache, work_item->modalias);
+}
+
+/* Every worker keeps its kmod context, with the mapped module index, for
+ * its whole lifetime. */
+static void *module_thread(void *p) {
+        struct module_pool *pool = p;
+        struct kmod_ctx *ctx = NULL;
+        struct work_item *work_item;
+
+        prctl(PR_SET_NAME, (unsigned long) "module");
+
+        while ((work_item = module_pool_pop(pool))) {
+                uint64_t begin_usec;
+
+                __atomic_sub_fetch(&pool->n_queued, 1, __ATOMIC_RELAXED);
+
+                if (!ctx)
+                        ctx = module_ctx_new();
+
+                begin_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+                if (ctx)
+                        module_resolve(pool, ctx, work_item);
+
+                metrics_histogram_add(&pool->resolve_usec, c_usec_from_clock(CLOCK_BOOTTIME) - begin_usec);
+                metrics_histogram_add(&pool->queued_usec[work_item->class],
+                                      c_usec_from_clock(CLOCK_BOOTTIME) - work_item->queued_usec);
+
+                work_item->next_done = __atomic_load_n(&pool->done, __ATOMIC_RELAXED);
+                while (!__atomic_compare_exchange_n(&pool->done, &work_item->next_done, work_item, true,
+                                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                        ;
         }
 
-finish:
         kmod_unref(ctx);
-        work_item_free(work_item);
         return NULL;
 }
 
-int module_load(Manager *m, const char *modalias) {
+/* Forget the finished work items. */
+static void module_pool_reap(struct module_pool *pool) {
+        struct work_item *work_item, *next;
+
+        work_item = __atomic_exchange_n(&pool->done, NULL, __ATOMIC_ACQUIRE);
+        for (; work_item; work_item = next) {
+                next = work_item->next_done;
+                c_rbtree_remove(&pool->work_items, &work_item->rb);
+                work_item_free(work_item);
+        }
+}
+
+struct module_pool *module_pool_free(struct module_pool *pool) {
+        CRBNode *n;
+
+        if (!pool)
+                return NULL;
+
+        __atomic_store_n(&pool->stop, true, __ATOMIC_RELEASE);
+        module_park_wake(&pool->park_work, INT_MAX);
+
+        for (size_t i = 0; i < pool->n_threads; i++)
+                pthread_join(pool->threads[i], NULL);
+
+        module_pool_reap(pool);
+
+        while ((n = c_rbtree_first(&pool->work_items))) {
+                c_rbtree_remove(&pool->work_items, n);
+                work_item_free(c_container_of(n, struct work_item, rb));
+        }
+
+        while ((n = c_rbtree_first(&pool->modules))) {
+                c_rbtree_remove(&pool->modules, n);
+                free(c_container_of(n, struct module_name, rb));
+        }
+
+        modalias_cache_free(pool->modalias_cache);
+        pthread_mutex_destroy(&pool->overflow_lock);
+        pthread_mutex_destroy(&pool->modules_lock);
+        free(pool->threads);
+        free(pool);
+
+        return NULL;
+}
+
+static int module_pool_new(struct module_pool **poolp, size_t n_threads) {
+        struct module_pool *pool;
+        int r;
+
+        pool = calloc(1, sizeof(*pool));
+        if (!pool)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < _MODULE_CLASS_N; i++) {
+                module_queue_init(&pool->queues[i]);
+                c_list_init(&pool->overflow[i]);
+        }
+        pthread_mutex_init(&pool->overflow_lock, NULL);
+        pthread_mutex_init(&pool->modules_lock, NULL);
+
+        /* A kernel without a module index has nothing to cache. */
+        r = modalias_cache_new(&pool->modalias_cache, MODALIAS_CACHE_FILE);
+        if (r < 0 && r != -ENOENT)
+                kmsg(LOG_WARNING, "Unable to use modalias cache: %s.", strerror(-r));
+
+        pool->threads = calloc(n_threads, sizeof(pthread_t));
+        if (!pool->threads) {
+                module_pool_free(pool);
+                return -ENOMEM;
+        }
+
+        for (; pool->n_threads < n_threads; pool->n_threads++)
+                if (pthread_create(&pool->threads[pool->n_threads], NULL, module_thread, pool) != 0)
+                        break;
+
+        if (pool->n_threads == 0) {
+                module_pool_free(pool);
+                return -EAGAIN;
+        }
+
+        *poolp = pool;
+
+        return 0;
+}
+
+int module_load(Manager *m, const char *subsystem, const char *modalias) {
         struct work_item *work_item;
+        CRBNode **slot, *p;
         int r;
 
         assert(m);
         assert(modalias);
 
-        r = work_item_new(&work_item, modalias);
+        /* The workers are started on first use, after the main thread
+         * dropped its privileges; threads inherit the credentials. */
+        if (!m->module_pool) {
+                r = module_pool_new(&m->module_pool, m->max_workers);
+                if (r < 0)
+                        return r;
+
+                kmsg(LOG_INFO, "Started %zu module loading workers.", m->module_pool->n_threads);
+        }
+
+        module_pool_reap(m->module_pool);
+
+        /* Many devices share the same modalias, like CPUs or USB ports;
+         * while the lookup and the probe of the first one is pending, the
+         * others are skipped. */
+        slot = c_rbtree_find_slot(&m->module_pool->work_items, work_items_compare, modalias, &p);
+        if (!slot) {
+                m->module_pool->n_modalias_hits++;
+                return 0;
+        }
+
+        m->module_pool->n_modaliases++;
+
+        if (m->module_pool->modalias_cache &&
+            modalias_cache_contains(m->module_pool->modalias_cache, modalias)) {
+                m->module_pool->n_modalias_cache_hits++;
+                return 0;
+        }
+
+        r = work_item_new(&work_item, modalias, module_class(subsystem, modalias));
         if (r < 0)
                 return r;
 
-        pthread_mutex_lock(&m->worker_lock);
-        work_item_push(m, work_item);
-        if (m->n_workers < m->max_workers) {
-                _c_cleanup_(pthread_attr_destroy) pthread_attr_t a;
-                pthread_t t;
+        c_rbtree_add(&m->module_pool->work_items, p, slot, &work_item->rb);
+
+        module_pool_push(m->module_pool, work_item);
+
+        return 0;
+}
+
+void module_log_stats(Manager *m) {
+        struct module_pool *pool = m->module_pool;
+
+        if (!pool)
+                return;
+
+        kmsg(LOG_INFO, "Looked up %" PRIu64 " modaliases, %" PRIu64 " duplicates skipped, %" PRIu64 " without a module; "
+             "%" PRIu64 " modules loaded, %" PRIu64 " already present, %" PRIu64 " cache hits.",
+             pool->n_modaliases, pool->n_modalias_hits, pool->n_modalias_cache_hits,
+             __atomic_load_n(&pool->n_modules_loaded, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->n_modules_present, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool->n_module_hits, __ATOMIC_RELAXED));
 
-                r = pthread_attr_init(&a);
-                assert(r == 0); /* On Linux this cannot fail. */
+        for (size_t i = 0; i < _MODULE_CLASS_N; i++) {
+                struct metrics_histogram *h = &pool->queued_usec[i];
 
-                r = pthread_attr_setdetachstate(&a, PTHREAD_CREATE_DETACHED);
-                if (r > 0)
-                        goto unlock;
+                if (h->n_values == 0)
+                        continue;
 
-                r = pthread_create(&t, &a, module_thread, m);
-                if (r > 0)
-                        goto unlock;
+                kmsg(LOG_INFO, "Resolved %" PRIu64 " %s modaliases, %" PRIu64 " ms average, %" PRIu64 " ms maximum.",
+                     h->n_values, module_class_names[i], h->sum / h->n_values / 1000, h->max / 1000);
+        }
+}
+
+void module_write_stats(Manager *m, FILE *f) {
+        struct module_pool *pool = m->module_pool;
 
-                m->n_workers ++;
+        if (!pool)
+                return;
+
+        fprintf(f, "module_workers %zu\n", pool->n_threads);
+        fprintf(f, "module_queued %" PRIu64 "\n", __atomic_load_n(&pool->n_queued, __ATOMIC_RELAXED));
+        fprintf(f, "module_queued_max %" PRIu64 "\n", pool->max_queued);
+        fprintf(f, "module_overflowed %" PRIu64 "\n", pool->n_overflowed);
+        fprintf(f, "modaliases %" PRIu64 "\n", pool->n_modaliases);
+        fprintf(f, "modalias_duplicates %" PRIu64 "\n", pool->n_modalias_hits);
+        fprintf(f, "modalias_cache_hits %" PRIu64 "\n", pool->n_modalias_cache_hits);
+        fprintf(f, "modules_loaded %" PRIu64 "\n", __atomic_load_n(&pool->n_modules_loaded, __ATOMIC_RELAXED));
+        fprintf(f, "modules_present %" PRIu64 "\n", __atomic_load_n(&pool->n_modules_present, __ATOMIC_RELAXED));
+        fprintf(f, "module_cache_hits %" PRIu64 "\n", __atomic_load_n(&pool->n_module_hits, __ATOMIC_RELAXED));
+
+        metrics_histogram_write(f, "modalias_resolve_usec", &pool->resolve_usec);
+        for (size_t i = 0; i < _MODULE_CLASS_N; i++) {
+                char name[64];
+
+                snprintf(name, sizeof(name), "modalias_%s_usec", module_class_names[i]);
+                metrics_histogram_write(f, name, &pool->queued_usec[i]);
         }
+}
 
-unlock:
-        pthread_mutex_unlock(&m->worker_lock);
+int module_save_cache(Manager *m) {
+        if (!m->module_pool || !m->module_pool->modalias_cache)
+                return 0;
 
-        return -r;
+        return modalias_cache_save(m->module_pool->modalias_cache);
 }
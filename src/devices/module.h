@@ -18,7 +18,17 @@
 
 #include "manager.h"
 
-struct work_item *work_item_free(struct work_item *work_item);
-struct work_item *work_item_pop(Manager *m);
+/* The queues of the module workers, in the order they are drained. */
+enum {
+        MODULE_CLASS_STORAGE,           /* Disk drivers, the boot waits for them. */
+        MODULE_CLASS_BUS,               /* Controllers storage can be attached to. */
+        MODULE_CLASS_DEFAULT,
+        _MODULE_CLASS_N,
+};
 
-int module_load(Manager *m, const char *modalias);
+struct module_pool *module_pool_free(struct module_pool *pool);
+
+int module_load(Manager *m, const char *subsystem, const char *modalias);
+void module_log_stats(Manager *m);
+void module_write_stats(Manager *m, FILE *f);
+int module_save_cache(Manager *m);
@@ -0,0 +1,556 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-list.h>
+#include <c-macro.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <org.bus1/b1-devices-events.h>
+#include "manager.h"
+#include "monitor.h"
+#include "shared/kmsg.h"
+#include "uevent.h"
+
+/* Local subscribers to the device events, see b1-devices-events.h. The
+ * events are queued per client while a batch of uevents is handled and
+ * sent with a single sendmmsg() at the end of the batch. A client whose
+ * queue overflows is disconnected; it can reconnect and catch up with
+ * the device snapshot. */
+
+#define MONITOR_CLIENTS_MAX 64
+#define MONITOR_QUEUE_SIZE 256
+#define MONITOR_BUFFER_SIZE (64 * 1024)
+
+static const uint32_t monitor_actions[] = {
+        [UEVENT_ACTION_ADD] = BUS1_DEVICES_ACTION_ADD,
+        [UEVENT_ACTION_CHANGE] = BUS1_DEVICES_ACTION_CHANGE,
+        [UEVENT_ACTION_REMOVE] = BUS1_DEVICES_ACTION_REMOVE,
+        [UEVENT_ACTION_MOVE] = BUS1_DEVICES_ACTION_MOVE,
+        [UEVENT_ACTION_ONLINE] = BUS1_DEVICES_ACTION_ONLINE,
+        [UEVENT_ACTION_OFFLINE] = BUS1_DEVICES_ACTION_OFFLINE,
+};
+
+struct monitor_client {
+        Monitor *monitor;
+        CListEntry le;
+        int fd;
+        bool dropped;                   /* Freed with the next flush. */
+        bool blocked;                   /* Waiting for EPOLLOUT. */
+        bool settled;
+        struct uevent_subscription settle;
+
+        Bus1DevicesEventFilter filters[BUS1_DEVICES_EVENTS_FILTERS_MAX];
+        size_t n_filters;
+
+        /* Messages not sent yet, stored back to back in the buffer. */
+        uint32_t offsets[MONITOR_QUEUE_SIZE];
+        uint32_t sizes[MONITOR_QUEUE_SIZE];
+        unsigned int n_queued;
+        unsigned int n_sent;
+        size_t n_buf;
+        char buf[MONITOR_BUFFER_SIZE];
+};
+
+struct Monitor {
+        Manager *manager;
+        int fd;
+        int fd_ep;                      /* The listening socket and the clients. */
+        CList clients;
+        size_t n_clients;
+
+        uint64_t n_clients_accepted;
+        uint64_t n_clients_dropped;
+        uint64_t n_events_queued;
+        uint64_t n_events_sent;
+        uint64_t n_flushes;
+};
+
+static struct monitor_client *monitor_client_free(struct monitor_client *client) {
+        if (!client)
+                return NULL;
+
+        if (!client->settled)
+                uevent_subscription_unlink(&client->monitor->manager->uevent_subscriptions, &client->settle);
+        uevent_subscription_destroy(&client->settle);
+
+        c_list_remove(&client->monitor->clients, &client->le);
+        client->monitor->n_clients--;
+        c_close(client->fd);
+        free(client);
+
+        return NULL;
+}
+
+static void monitor_client_drop(struct monitor_client *client, const char *reason) {
+        if (client->dropped)
+                return;
+
+        kmsg(LOG_WARNING, "Disconnecting device event subscriber: %s.", reason);
+        client->dropped = true;
+        client->monitor->n_clients_dropped++;
+}
+
+static int monitor_client_enqueue(struct monitor_client *client, const Bus1DevicesEvent *event,
+                                  const char **strings, const uint16_t *sizes, size_t n_strings) {
+        size_t n = sizeof(*event);
+        char *p;
+
+        if (client->dropped)
+                return 0;
+
+        for (size_t i = 0; i < n_strings; i++)
+                n += sizes[i];
+
+        /* Move the unsent messages to the front. */
+        if (client->n_sent > 0 &&
+            (client->n_queued == MONITOR_QUEUE_SIZE || client->n_buf + n > MONITOR_BUFFER_SIZE)) {
+                size_t start = client->offsets[client->n_sent];
+
+                memmove(client->buf, client->buf + start, client->n_buf - start);
+                client->n_buf -= start;
+                for (unsigned int i = client->n_sent; i < client->n_queued; i++)
+                        client->offsets[i - client->n_sent] = client->offsets[i] - start;
+                memmove(client->sizes, client->sizes + client->n_sent,
+                        (client->n_queued - client->n_sent) * sizeof(uint32_t));
+                client->n_queued -= client->n_sent;
+                client->n_sent = 0;
+        }
+
+        if (client->n_queued == MONITOR_QUEUE_SIZE || client->n_buf + n > MONITOR_BUFFER_SIZE) {
+                monitor_client_drop(client, "queue overflow");
+                return -ENOBUFS;
+        }
+
+        p = client->buf + client->n_buf;
+        memcpy(p, event, sizeof(*event));
+        p += sizeof(*event);
+        for (size_t i = 0; i < n_strings; i++) {
+                if (sizes[i] == 0)
+                        continue;
+
+                memcpy(p, strings[i], sizes[i]);
+                p += sizes[i];
+        }
+
+        client->offsets[client->n_queued] = client->n_buf;
+        client->sizes[client->n_queued] = n;
+        client->n_queued++;
+        client->n_buf += n;
+        client->monitor->n_events_queued++;
+
+        return 0;
+}
+
+static bool monitor_filter_match(const Bus1DevicesEventFilter *filter, uint32_t action,
+                                 const char *subsystem, const char *devtype, const char *devname) {
+        if (filter->actions && !(filter->actions & (1U << action)))
+                return false;
+
+        if (filter->subsystem[0] && (!subsystem || strcmp(filter->subsystem, subsystem) != 0))
+                return false;
+
+        if (filter->devtype[0] && (!devtype || strcmp(filter->devtype, devtype) != 0))
+                return false;
+
+        if (filter->devname[0] && (!devname || fnmatch(filter->devname, devname, 0) != 0))
+                return false;
+
+        return true;
+}
+
+static bool monitor_client_match(struct monitor_client *client, uint32_t action,
+                                 const char *subsystem, const char *devtype, const char *devname) {
+        if (client->n_filters == 0)
+                return true;
+
+        for (size_t i = 0; i < client->n_filters; i++)
+                if (monitor_filter_match(&client->filters[i], action, subsystem, devtype, devname))
+                        return true;
+
+        return false;
+}
+
+static uint16_t monitor_string_size(const char *string) {
+        size_t n;
+
+        if (!string)
+                return 0;
+
+        n = strlen(string) + 1;
+
+        return n > UINT16_MAX ? 0 : n;
+}
+
+/* Queue an event which has been applied to the device tree for all
+ * interested clients. */
+void monitor_queue(Monitor *monitor, int action, uint64_t seqnum,
+                   const char *devpath, const char *devpath_old,
+                   const char *subsystem, const char *devtype,
+                   const char *devname, const char *modalias) {
+        const char *strings[] = { devpath, devpath_old, subsystem, devtype, devname, modalias };
+        Bus1DevicesEvent event = {
+                .seqnum = seqnum,
+                .action = monitor_actions[action],
+        };
+        uint16_t sizes[C_ARRAY_SIZE(strings)];
+
+        if (!monitor || !c_list_first(&monitor->clients))
+                return;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(strings); i++)
+                sizes[i] = monitor_string_size(strings[i]);
+
+        event.n_devpath = sizes[0];
+        event.n_devpath_old = sizes[1];
+        event.n_subsystem = sizes[2];
+        event.n_devtype = sizes[3];
+        event.n_devname = sizes[4];
+        event.n_modalias = sizes[5];
+
+        for (CListEntry *le = c_list_first(&monitor->clients); le; le = c_list_entry_next(le)) {
+                struct monitor_client *client = c_container_of(le, struct monitor_client, le);
+
+                if (!monitor_client_match(client, event.action, subsystem, devtype, devname))
+                        continue;
+
+                monitor_client_enqueue(client, &event, strings, sizes, C_ARRAY_SIZE(strings));
+        }
+}
+
+/* All uevents from before the connection are processed. */
+static int monitor_client_settle_cb(void *userdata) {
+        struct monitor_client *client = userdata;
+        Bus1DevicesEvent event = {
+                .seqnum = client->settle.seqnum,
+                .action = BUS1_DEVICES_ACTION_SETTLED,
+        };
+
+        client->settled = true;
+        monitor_client_enqueue(client, &event, NULL, NULL, 0);
+
+        return 0;
+}
+
+static void monitor_client_send(struct monitor_client *client) {
+        struct mmsghdr msgs[MONITOR_QUEUE_SIZE];
+        struct iovec iovs[MONITOR_QUEUE_SIZE];
+        unsigned int n = 0;
+        int r;
+
+        for (unsigned int i = client->n_sent; i < client->n_queued; i++, n++) {
+                iovs[n] = (struct iovec){ client->buf + client->offsets[i], client->sizes[i] };
+                msgs[n] = (struct mmsghdr){ .msg_hdr = { .msg_iov = &iovs[n], .msg_iovlen = 1 } };
+        }
+
+        while (n > 0) {
+                r = sendmmsg(client->fd, msgs, n, MSG_DONTWAIT|MSG_NOSIGNAL);
+                if (r < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno != EAGAIN)
+                                monitor_client_drop(client, strerror(errno));
+
+                        break;
+                }
+
+                client->n_sent += r;
+                client->monitor->n_events_sent += r;
+                memmove(msgs, msgs + r, (n - r) * sizeof(struct mmsghdr));
+                n -= r;
+        }
+
+        if (client->n_sent == client->n_queued) {
+                client->n_queued = 0;
+                client->n_sent = 0;
+                client->n_buf = 0;
+        }
+}
+
+static void monitor_client_update_events(struct monitor_client *client) {
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.ptr = client,
+        };
+        bool blocked = client->n_sent < client->n_queued;
+
+        if (blocked == client->blocked)
+                return;
+
+        if (blocked)
+                ev.events |= EPOLLOUT;
+
+        if (epoll_ctl(client->monitor->fd_ep, EPOLL_CTL_MOD, client->fd, &ev) < 0)
+                monitor_client_drop(client, strerror(errno));
+        else
+                client->blocked = blocked;
+}
+
+/* Send the queued events, called at the end of every batch of uevents. */
+void monitor_flush(Monitor *monitor) {
+        CListEntry *le, *next;
+
+        if (!monitor)
+                return;
+
+        monitor->n_flushes++;
+
+        for (le = c_list_first(&monitor->clients); le; le = next) {
+                struct monitor_client *client = c_container_of(le, struct monitor_client, le);
+
+                next = c_list_entry_next(le);
+
+                if (!client->dropped && client->n_sent < client->n_queued) {
+                        monitor_client_send(client);
+                        monitor_client_update_events(client);
+                }
+
+                if (client->dropped)
+                        monitor_client_free(client);
+        }
+}
+
+static void monitor_client_receive(struct monitor_client *client);
+
+/* Returns 1 if a client was accepted, 0 if there are no more pending. */
+static int monitor_accept(Monitor *monitor) {
+        Manager *m = monitor->manager;
+        struct monitor_client *client;
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+        };
+        _c_cleanup_(c_closep) int fd = -1;
+        int r;
+
+        fd = accept4(monitor->fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+        if (fd < 0)
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -errno;
+
+        if (monitor->n_clients >= MONITOR_CLIENTS_MAX)
+                return 1;
+
+        client = malloc(sizeof(*client));
+        if (!client)
+                return -ENOMEM;
+
+        client->monitor = monitor;
+        client->fd = fd;
+        fd = -1;
+        client->dropped = false;
+        client->blocked = false;
+        client->settled = false;
+        client->n_filters = 0;
+        client->n_queued = 0;
+        client->n_sent = 0;
+        client->n_buf = 0;
+        uevent_subscription_init(&client->settle);
+        c_list_entry_init(&client->le);
+        c_list_append(&monitor->clients, &client->le);
+        monitor->n_clients++;
+        monitor->n_clients_accepted++;
+
+        r = uevent_sysfs_sync(&m->uevent_subscriptions, m->sysfd, &client->settle,
+                              monitor_client_settle_cb, client);
+        if (r < 0) {
+                client->settled = true;
+                monitor_client_free(client);
+                return r;
+        }
+
+        ev.data.ptr = client;
+        if (epoll_ctl(monitor->fd_ep, EPOLL_CTL_ADD, client->fd, &ev) < 0) {
+                r = -errno;
+                monitor_client_free(client);
+                return r;
+        }
+
+        /* Filters sent right after connecting apply to all events. */
+        monitor_client_receive(client);
+
+        return 1;
+}
+
+static void monitor_client_receive(struct monitor_client *client) {
+        Bus1DevicesEventFilter filter;
+        ssize_t len;
+
+        for (;;) {
+                len = recv(client->fd, &filter, sizeof(filter), MSG_DONTWAIT);
+                if (len < 0) {
+                        if (errno == EINTR)
+                                continue;
+
+                        if (errno != EAGAIN)
+                                monitor_client_drop(client, strerror(errno));
+
+                        return;
+                }
+
+                /* Disconnected. */
+                if (len == 0) {
+                        client->dropped = true;
+                        return;
+                }
+
+                if (len != sizeof(filter) || client->n_filters >= BUS1_DEVICES_EVENTS_FILTERS_MAX) {
+                        monitor_client_drop(client, "invalid filter");
+                        return;
+                }
+
+                filter.subsystem[sizeof(filter.subsystem) - 1] = '\0';
+                filter.devtype[sizeof(filter.devtype) - 1] = '\0';
+                filter.devname[sizeof(filter.devname) - 1] = '\0';
+                client->filters[client->n_filters++] = filter;
+        }
+}
+
+int monitor_dispatch(Monitor *monitor) {
+        struct epoll_event events[16];
+        int n, r;
+
+        n = epoll_wait(monitor->fd_ep, events, C_ARRAY_SIZE(events), 0);
+        if (n < 0)
+                return errno == EINTR ? 0 : -errno;
+
+        for (int i = 0; i < n; i++) {
+                struct monitor_client *client = events[i].data.ptr;
+
+                if (!client) {
+                        do {
+                                r = monitor_accept(monitor);
+                        } while (r > 0);
+                        if (r < 0)
+                                kmsg(LOG_WARNING, "Unable to accept device event subscriber: %s.", strerror(-r));
+
+                        continue;
+                }
+
+                if (events[i].events & (EPOLLHUP|EPOLLERR))
+                        client->dropped = true;
+                else if (events[i].events & EPOLLIN)
+                        monitor_client_receive(client);
+        }
+
+        /* Clients which became writable or hung up. */
+        monitor_flush(monitor);
+
+        return 0;
+}
+
+int monitor_get_fd(Monitor *monitor) {
+        return monitor->fd_ep;
+}
+
+Monitor *monitor_free(Monitor *monitor) {
+        CListEntry *le;
+
+        if (!monitor)
+                return NULL;
+
+        while ((le = c_list_first(&monitor->clients)))
+                monitor_client_free(c_container_of(le, struct monitor_client, le));
+
+        c_close(monitor->fd_ep);
+        c_close(monitor->fd);
+        free(monitor);
+
+        return NULL;
+}
+
+int monitor_new(Monitor **monitorp, Manager *manager, const char *path) {
+        _c_cleanup_(monitor_freep) Monitor *monitor = NULL;
+        _c_cleanup_(c_freep) char *dir = NULL;
+        struct sockaddr_un sa = {
+                .sun_family = AF_UNIX,
+        };
+        struct epoll_event ev = {
+                .events = EPOLLIN,
+                .data.ptr = NULL,
+        };
+        char *s;
+
+        if (strlen(path) >= sizeof(sa.sun_path))
+                return -EINVAL;
+
+        strcpy(sa.sun_path, path);
+
+        dir = strdup(path);
+        if (!dir)
+                return -ENOMEM;
+
+        s = strrchr(dir, '/');
+        if (s && s != dir) {
+                *s = '\0';
+                if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+                        return -errno;
+        }
+
+        monitor = calloc(1, sizeof(Monitor));
+        if (!monitor)
+                return -ENOMEM;
+
+        monitor->manager = manager;
+        monitor->fd = -1;
+        monitor->fd_ep = -1;
+        c_list_init(&monitor->clients);
+
+        monitor->fd = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+        if (monitor->fd < 0)
+                return -errno;
+
+        /* Replace the socket of an earlier instance. */
+        if (unlink(path) < 0 && errno != ENOENT)
+                return -errno;
+
+        if (bind(monitor->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+                return -errno;
+
+        /* Everybody can subscribe, uevents are public anyway. */
+        if (chmod(path, 0666) < 0)
+                return -errno;
+
+        if (listen(monitor->fd, 16) < 0)
+                return -errno;
+
+        monitor->fd_ep = epoll_create1(EPOLL_CLOEXEC);
+        if (monitor->fd_ep < 0)
+                return -errno;
+
+        if (epoll_ctl(monitor->fd_ep, EPOLL_CTL_ADD, monitor->fd, &ev) < 0)
+                return -errno;
+
+        *monitorp = monitor;
+        monitor = NULL;
+
+        return 0;
+}
+
+void monitor_write_stats(Monitor *monitor, FILE *f) {
+        if (!monitor)
+                return;
+
+        fprintf(f, "monitor_clients %zu\n", monitor->n_clients);
+        fprintf(f, "monitor_clients_accepted %" PRIu64 "\n", monitor->n_clients_accepted);
+        fprintf(f, "monitor_clients_dropped %" PRIu64 "\n", monitor->n_clients_dropped);
+        fprintf(f, "monitor_events_queued %" PRIu64 "\n", monitor->n_events_queued);
+        fprintf(f, "monitor_events_sent %" PRIu64 "\n", monitor->n_events_sent);
+        fprintf(f, "monitor_flushes %" PRIu64 "\n", monitor->n_flushes);
+}
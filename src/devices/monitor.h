@@ -0,0 +1,39 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <stdio.h>
+
+typedef struct Manager Manager;
+typedef struct Monitor Monitor;
+
+Monitor *monitor_free(Monitor *monitor);
+int monitor_new(Monitor **monitorp, Manager *manager, const char *path);
+
+int monitor_get_fd(Monitor *monitor);
+int monitor_dispatch(Monitor *monitor);
+
+void monitor_queue(Monitor *monitor, int action, uint64_t seqnum,
+                   const char *devpath, const char *devpath_old,
+                   const char *subsystem, const char *devtype,
+                   const char *devname, const char *modalias);
+void monitor_flush(Monitor *monitor);
+
+void monitor_write_stats(Monitor *monitor, FILE *f);
+
+C_DEFINE_CLEANUP(Monitor *, monitor_free);
@@ -16,11 +16,59 @@
 ***/
 
 #include <c-macro.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <org.bus1/b1-identity.h>
+#include "shared/kmsg.h"
 #include "permissions.h"
 
+/* NULL matches everything. */
+struct permissions_rule {
+        char *subsystem;
+        char *devtype;
+        char *devname;
+        char *modalias;
+        size_t n_modalias;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+};
+
+/* The candidates of a devtype, in rule order. */
+struct permissions_devtype {
+        const struct permissions_rule **rules;
+        size_t n_rules;
+};
+
+/* Coldplug applies the rules to many nodes at once. */
+#define PERMISSIONS_THREADS_MAX 4
+#define PERMISSIONS_OPS_PER_THREAD 64
+
+struct permissions_op {
+        const char *devname;
+        const struct permissions_rule *rule;
+        int result;
+};
+
+struct permissions_batch {
+        int devfd;
+        struct permissions_op *ops;
+        size_t n_ops;
+        size_t next;
+        size_t n_skipped;
+};
+
+struct Permissions {
+        struct permissions_rule *rules;
+        size_t n_rules;
+};
+
+/* The built-in rules, checked after the rules files. */
 static const struct permissions {
         const char *subsystem;
         const char *devtype;
@@ -35,30 +83,487 @@ static const struct permissions {
         { "usb",          "usb_device",   0660, BUS1_IDENTITY_USB,   BUS1_IDENTITY_USB },
 };
 
-int permissions_apply(int devfd, struct device *device) {
+static const struct {
+        const char *name;
+        unsigned int id;
+} permissions_identities[] = {
+        { "root",       BUS1_IDENTITY_ROOT },
+        { "input",      BUS1_IDENTITY_INPUT },
+        { "audio",      BUS1_IDENTITY_AUDIO },
+        { "video",      BUS1_IDENTITY_VIDEO },
+        { "disk",       BUS1_IDENTITY_DISK },
+        { "usb",        BUS1_IDENTITY_USB },
+        { "smartcard",  BUS1_IDENTITY_SMARTCARD },
+};
+
+static int permissions_parse_identity(const char *s, unsigned int *idp) {
+        unsigned long id;
+        char *e;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(permissions_identities); i++) {
+                if (strcmp(s, permissions_identities[i].name) == 0) {
+                        *idp = permissions_identities[i].id;
+                        return 0;
+                }
+        }
+
+        errno = 0;
+        id = strtoul(s, &e, 10);
+        if (errno != 0 || *e != '\0' || e == s || id >= (unsigned int)-1)
+                return -EINVAL;
+
+        *idp = id;
+
+        return 0;
+}
+
+static void permissions_rule_clear(struct permissions_rule *rule) {
+        free(rule->subsystem);
+        free(rule->devtype);
+        free(rule->devname);
+        free(rule->modalias);
+}
+
+static int permissions_rule_field(char **fieldp, const char *s) {
+        if (strcmp(s, "*") == 0) {
+                *fieldp = NULL;
+                return 0;
+        }
+
+        *fieldp = strdup(s);
+        if (!*fieldp)
+                return -ENOMEM;
+
+        return 0;
+}
+
+/* Returns 0 for empty lines, 1 if a rule was parsed. */
+static int permissions_rule_parse(struct permissions_rule *rule, char *line) {
+        char *fields[7];
+        size_t n_fields = 0;
+        unsigned int uid, gid;
+        unsigned long mode;
+        char *s, *e;
+        int r;
+
+        s = line + strcspn(line, "#\n");
+        *s = '\0';
+
+        for (s = strtok_r(line, " \t", &e); s; s = strtok_r(NULL, " \t", &e)) {
+                if (n_fields >= C_ARRAY_SIZE(fields))
+                        return -EINVAL;
+
+                fields[n_fields++] = s;
+        }
+
+        if (n_fields == 0)
+                return 0;
+
+        if (n_fields != C_ARRAY_SIZE(fields))
+                return -EINVAL;
+
+        errno = 0;
+        mode = strtoul(fields[4], &e, 8);
+        if (errno != 0 || *e != '\0' || mode > 07777)
+                return -EINVAL;
+
+        if (permissions_parse_identity(fields[5], &uid) < 0 ||
+            permissions_parse_identity(fields[6], &gid) < 0)
+                return -EINVAL;
+
+        *rule = (struct permissions_rule){
+                .mode = mode,
+                .uid = uid,
+                .gid = gid,
+        };
+
+        if ((r = permissions_rule_field(&rule->subsystem, fields[0])) < 0 ||
+            (r = permissions_rule_field(&rule->devtype, fields[1])) < 0 ||
+            (r = permissions_rule_field(&rule->devname, fields[2])) < 0 ||
+            (r = permissions_rule_field(&rule->modalias, fields[3])) < 0) {
+                permissions_rule_clear(rule);
+                return r;
+        }
+
+        rule->n_modalias = rule->modalias ? strlen(rule->modalias) : 0;
+
+        return 1;
+}
+
+static int permissions_add(Permissions *permissions, const struct permissions_rule *rule) {
+        struct permissions_rule *rules;
+
+        rules = realloc(permissions->rules, (permissions->n_rules + 1) * sizeof(*rules));
+        if (!rules)
+                return -ENOMEM;
+
+        rules[permissions->n_rules++] = *rule;
+        permissions->rules = rules;
+
+        return 0;
+}
+
+static int permissions_read_file(Permissions *permissions, int dfd, const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        _c_cleanup_(c_freep) char *line = NULL;
+        unsigned int n_line = 0;
+        size_t size = 0;
+        int fd, r;
+
+        fd = openat(dfd, file, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
+                return -errno;
+
+        f = fdopen(fd, "re");
+        if (!f) {
+                c_close(fd);
+                return -errno;
+        }
+
+        while (getline(&line, &size, f) >= 0) {
+                struct permissions_rule rule;
+
+                n_line++;
+
+                r = permissions_rule_parse(&rule, line);
+                if (r == -EINVAL) {
+                        kmsg(LOG_WARNING, "Invalid permission rule in %s:%u.", file, n_line);
+                        continue;
+                }
+                if (r < 0)
+                        return r;
+                if (r == 0)
+                        continue;
+
+                r = permissions_add(permissions, &rule);
+                if (r < 0) {
+                        permissions_rule_clear(&rule);
+                        return r;
+                }
+        }
+
+        return 0;
+}
+
+static int permissions_file_compare(const void *a, const void *b) {
+        return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int permissions_read_dir(Permissions *permissions, const char *dir) {
+        _c_cleanup_(c_closedirp) DIR *d = NULL;
+        char **files = NULL;
+        size_t n_files = 0;
+        int r = 0;
+
+        d = opendir(dir);
+        if (!d)
+                return -errno;
+
+        for (struct dirent *de = readdir(d); de; de = readdir(d)) {
+                size_t l = strlen(de->d_name);
+                char **f;
+
+                if (de->d_name[0] == '.' || l <= strlen(".rules") ||
+                    strcmp(de->d_name + l - strlen(".rules"), ".rules") != 0)
+                        continue;
+
+                f = realloc(files, (n_files + 1) * sizeof(char *));
+                if (!f) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+                files = f;
+
+                files[n_files] = strdup(de->d_name);
+                if (!files[n_files]) {
+                        r = -ENOMEM;
+                        goto finish;
+                }
+                n_files++;
+        }
+
+        if (n_files > 0)
+                qsort(files, n_files, sizeof(char *), permissions_file_compare);
+
+        for (size_t i = 0; i < n_files; i++) {
+                r = permissions_read_file(permissions, dirfd(d), files[i]);
+                if (r < 0) {
+                        kmsg(LOG_WARNING, "Unable to read permission rules %s/%s: %s.", dir, files[i], strerror(-r));
+                        if (r == -ENOMEM)
+                                goto finish;
+                        r = 0;
+                }
+        }
+
+finish:
+        for (size_t i = 0; i < n_files; i++)
+                free(files[i]);
+        free(files);
+
+        return r;
+}
+
+Permissions *permissions_free(Permissions *permissions) {
+        if (!permissions)
+                return NULL;
+
+        for (size_t i = 0; i < permissions->n_rules; i++)
+                permissions_rule_clear(&permissions->rules[i]);
+
+        free(permissions->rules);
+        free(permissions);
+
+        return NULL;
+}
+
+int permissions_new(Permissions **permissionsp, const char *dir) {
+        _c_cleanup_(permissions_freep) Permissions *permissions = NULL;
+        int r;
+
+        permissions = calloc(1, sizeof(Permissions));
+        if (!permissions)
+                return -ENOMEM;
+
+        r = permissions_read_dir(permissions, dir);
+        if (r < 0 && r != -ENOENT)
+                return r;
+
         for (size_t i = 0; i < C_ARRAY_SIZE(device_permissions); i++) {
-                uid_t uid = device_permissions[i].uid;
-                gid_t gid = device_permissions[i].gid;
-                mode_t mode = device_permissions[i].mode;
+                const struct permissions *d = &device_permissions[i];
+                struct permissions_rule rule = {
+                        .mode = d->mode,
+                        .uid = d->uid,
+                        .gid = d->gid,
+                };
+
+                rule.subsystem = strdup(d->subsystem);
+                rule.devtype = d->devtype ? strdup(d->devtype) : NULL;
+                if (!rule.subsystem || (d->devtype && !rule.devtype)) {
+                        permissions_rule_clear(&rule);
+                        return -ENOMEM;
+                }
+
+                r = permissions_add(permissions, &rule);
+                if (r < 0) {
+                        permissions_rule_clear(&rule);
+                        return r;
+                }
+        }
+
+        kmsg(LOG_INFO, "Loaded %zu device permission rules.", permissions->n_rules);
+
+        *permissionsp = permissions;
+        permissions = NULL;
+
+        return 0;
+}
+
+/* Collect the rules which can match a devtype, this is done once for
+ * every subsystem/devtype pair; matching a device only needs to look at
+ * the rules which also check the devname or modalias. */
+static int permissions_compile(Permissions *permissions, struct devtype *devtype) {
+        struct permissions_devtype *compiled;
+        const char *subsystem = devtype->subsystem->name;
+
+        compiled = calloc(1, sizeof(*compiled));
+        if (!compiled)
+                return -ENOMEM;
+
+        for (size_t i = 0; i < permissions->n_rules; i++) {
+                const struct permissions_rule *rule = &permissions->rules[i];
+                const struct permissions_rule **rules;
 
-                if (device_permissions[i].subsystem)
-                        if (strcmp(device->devtype->subsystem->name, device_permissions[i].subsystem) != 0)
-                                continue;
+                if (rule->subsystem && strcmp(rule->subsystem, subsystem) != 0)
+                        continue;
 
-                if (device->devtype->name && device_permissions[i].devtype)
-                        if (strcmp(device->devtype->name, device_permissions[i].devtype) != 0)
-                                continue;
+                if (rule->devtype && (!devtype->name || strcmp(rule->devtype, devtype->name) != 0))
+                        continue;
 
-                if (mode > 0)
-                        if (fchmodat(devfd, device->devname, mode & 07777, 0) < 0)
-                                return -errno;
+                rules = realloc(compiled->rules, (compiled->n_rules + 1) * sizeof(*rules));
+                if (!rules) {
+                        free(compiled->rules);
+                        free(compiled);
+                        return -ENOMEM;
+                }
 
-                if (uid > 0 || gid > 0)
-                        if (fchownat(devfd, device->devname, uid, gid, AT_SYMLINK_NOFOLLOW) < 0)
-                                return -errno;
+                rules[compiled->n_rules++] = rule;
+                compiled->rules = rules;
 
+                /* Nothing after an unconditional rule can match. */
+                if (!rule->devname && !rule->modalias)
+                        break;
+        }
+
+        devtype->permissions = compiled;
+
+        return 0;
+}
+
+void permissions_devtype_free(struct permissions_devtype *compiled) {
+        if (!compiled)
+                return;
+
+        free(compiled->rules);
+        free(compiled);
+}
+
+static int permissions_find(Permissions *permissions, struct device *device,
+                            const struct permissions_rule **rulep) {
+        struct permissions_devtype *compiled;
+        int r;
+
+        *rulep = NULL;
+
+        /* Devices of a subsystem which disappeared. */
+        if (!device->devtype)
+                return 0;
+
+        if (!device->devtype->permissions) {
+                r = permissions_compile(permissions, device->devtype);
+                if (r < 0)
+                        return r;
+        }
+
+        compiled = device->devtype->permissions;
+
+        for (size_t i = 0; i < compiled->n_rules; i++) {
+                const struct permissions_rule *rule = compiled->rules[i];
+
+                if (rule->devname && fnmatch(rule->devname, device->devname, 0) != 0)
+                        continue;
+
+                if (rule->modalias && (!device->modalias ||
+                                       strncmp(device->modalias, rule->modalias, rule->n_modalias) != 0))
+                        continue;
+
+                *rulep = rule;
                 break;
         }
 
         return 0;
 }
+
+/* Returns 0 if the node already had the permissions of the rule. */
+static int permissions_set(int devfd, const char *devname, const struct permissions_rule *rule) {
+        bool set_mode = rule->mode > 0;
+        bool set_owner = rule->uid > 0 || rule->gid > 0;
+        struct stat st;
+
+        if (fstatat(devfd, devname, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                return -errno;
+
+        if ((st.st_mode & 07777) == (rule->mode & 07777))
+                set_mode = false;
+
+        if (st.st_uid == rule->uid && st.st_gid == rule->gid)
+                set_owner = false;
+
+        if (!set_mode && !set_owner)
+                return 0;
+
+        if (set_mode)
+                if (fchmodat(devfd, devname, rule->mode & 07777, 0) < 0)
+                        return -errno;
+
+        if (set_owner)
+                if (fchownat(devfd, devname, rule->uid, rule->gid, AT_SYMLINK_NOFOLLOW) < 0)
+                        return -errno;
+
+        return 1;
+}
+
+int permissions_apply(Permissions *permissions, int devfd, struct device *device) {
+        const struct permissions_rule *rule;
+        int r;
+
+        r = permissions_find(permissions, device, &rule);
+        if (r < 0)
+                return r;
+
+        if (!rule)
+                return 0;
+
+        r = permissions_set(devfd, device->devname, rule);
+        if (r < 0)
+                return r;
+
+        return 0;
+}
+
+static void *permissions_thread(void *p) {
+        struct permissions_batch *batch = p;
+
+        for (;;) {
+                struct permissions_op *op;
+                size_t i;
+
+                i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+                if (i >= batch->n_ops)
+                        break;
+
+                op = &batch->ops[i];
+                op->result = permissions_set(batch->devfd, op->devname, op->rule);
+                if (op->result == 0)
+                        __atomic_fetch_add(&batch->n_skipped, 1, __ATOMIC_RELAXED);
+        }
+
+        return NULL;
+}
+
+/* Apply the rules to all devices, the nodes are changed from a few
+ * threads. There is no io_uring operation for chmod or chown. Nodes
+ * which disappeared in the meantime are ignored. */
+int permissions_apply_all(Permissions *permissions, int devfd, struct device **devices, size_t n_devices) {
+        struct permissions_batch batch = {
+                .devfd = devfd,
+        };
+        pthread_t threads[PERMISSIONS_THREADS_MAX - 1];
+        size_t n_threads = 0;
+        int r = 0;
+
+        batch.ops = calloc(n_devices, sizeof(struct permissions_op));
+        if (!batch.ops)
+                return -ENOMEM;
+
+        /* Rules are compiled on first use, that is not thread-safe. */
+        for (size_t i = 0; i < n_devices; i++) {
+                const struct permissions_rule *rule;
+
+                r = permissions_find(permissions, devices[i], &rule);
+                if (r < 0)
+                        goto finish;
+
+                if (!rule)
+                        continue;
+
+                batch.ops[batch.n_ops++] = (struct permissions_op){
+                        .devname = devices[i]->devname,
+                        .rule = rule,
+                };
+        }
+
+        for (; n_threads < c_min(batch.n_ops / PERMISSIONS_OPS_PER_THREAD, C_ARRAY_SIZE(threads)); n_threads++)
+                if (pthread_create(&threads[n_threads], NULL, permissions_thread, &batch) != 0)
+                        break;
+
+        permissions_thread(&batch);
+
+        for (size_t i = 0; i < n_threads; i++)
+                pthread_join(threads[i], NULL);
+
+        for (size_t i = 0; i < batch.n_ops; i++) {
+                if (batch.ops[i].result >= 0 || batch.ops[i].result == -ENOENT)
+                        continue;
+
+                r = batch.ops[i].result;
+                break;
+        }
+
+        kmsg(LOG_INFO, "Applied permissions to %zu device nodes, %zu were unchanged.",
+             batch.n_ops, batch.n_skipped);
+
+finish:
+        free(batch.ops);
+
+        return r;
+}
@@ -18,4 +18,21 @@
 
 #include "device.h"
 
-int permissions_apply(int devfd, struct device *device);
+/* Rules are read from all *.rules files in the directory, in the
+ * alphabetical order of the file names. Every line is a rule:
+ *   SUBSYSTEM DEVTYPE DEVNAME MODALIAS MODE USER GROUP
+ * where "*" matches everything, DEVNAME is a glob pattern and MODALIAS
+ * a prefix; USER and GROUP are identity names or numbers. The first
+ * matching rule applies, the built-in rules are checked last. */
+#define PERMISSIONS_RULES_DIR "/usr/lib/org.bus1/devices"
+
+typedef struct Permissions Permissions;
+
+Permissions *permissions_free(Permissions *permissions);
+int permissions_new(Permissions **permissionsp, const char *dir);
+
+int permissions_apply(Permissions *permissions, int devfd, struct device *device);
+int permissions_apply_all(Permissions *permissions, int devfd, struct device **devices, size_t n_devices);
+void permissions_devtype_free(struct permissions_devtype *compiled);
+
+C_DEFINE_CLEANUP(Permissions *, permissions_free);
@@ -0,0 +1,230 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <org.bus1/b1-devices-snapshot.h>
+#include "device.h"
+#include "metrics.h"
+#include "snapshot.h"
+
+/* The device tree published for other services, see b1-devices-snapshot.h. */
+
+struct snapshot {
+        Bus1DevicesSnapshotEntry *entries;
+        size_t n_entries;
+        size_t n_entries_max;
+        char *strings;
+        size_t n_strings;
+        size_t n_strings_max;
+};
+
+static void snapshot_destroy(struct snapshot *snapshot) {
+        free(snapshot->entries);
+        free(snapshot->strings);
+}
+
+static int snapshot_add_string(struct snapshot *snapshot, const char *string, uint32_t *offsetp) {
+        size_t n;
+
+        if (!string) {
+                *offsetp = 0;
+                return 0;
+        }
+
+        n = strlen(string) + 1;
+        if (snapshot->n_strings + n > UINT32_MAX)
+                return -EFBIG;
+
+        if (snapshot->n_strings + n > snapshot->n_strings_max) {
+                size_t n_max = c_max(snapshot->n_strings_max * 2, snapshot->n_strings + n);
+                char *strings;
+
+                strings = realloc(snapshot->strings, n_max);
+                if (!strings)
+                        return -ENOMEM;
+
+                snapshot->strings = strings;
+                snapshot->n_strings_max = n_max;
+        }
+
+        memcpy(snapshot->strings + snapshot->n_strings, string, n);
+        *offsetp = snapshot->n_strings;
+        snapshot->n_strings += n;
+
+        return 0;
+}
+
+static int snapshot_add_device(struct snapshot *snapshot, struct device *device) {
+        Bus1DevicesSnapshotEntry *entry;
+        char devpath[PATH_MAX];
+        int r;
+
+        r = device_get_devpath(device, devpath, sizeof(devpath));
+        if (r < 0)
+                return r;
+
+        if (snapshot->n_entries >= snapshot->n_entries_max) {
+                size_t n_max = snapshot->n_entries_max ? snapshot->n_entries_max * 2 : 1024;
+                Bus1DevicesSnapshotEntry *entries;
+
+                entries = realloc(snapshot->entries, n_max * sizeof(*entries));
+                if (!entries)
+                        return -ENOMEM;
+
+                snapshot->entries = entries;
+                snapshot->n_entries_max = n_max;
+        }
+
+        entry = &snapshot->entries[snapshot->n_entries];
+
+        r = snapshot_add_string(snapshot, devpath, &entry->devpath);
+        if (r >= 0)
+                r = snapshot_add_string(snapshot, device->devtype->subsystem->name, &entry->subsystem);
+        if (r >= 0)
+                r = snapshot_add_string(snapshot, device->devtype->name, &entry->devtype);
+        if (r >= 0)
+                r = snapshot_add_string(snapshot, device->devname, &entry->devname);
+        if (r >= 0)
+                r = snapshot_add_string(snapshot, device->modalias, &entry->modalias);
+        if (r < 0)
+                return r;
+
+        snapshot->n_entries++;
+
+        return 0;
+}
+
+static int snapshot_compare(const void *a, const void *b, void *userdata) {
+        const Bus1DevicesSnapshotEntry *e1 = a, *e2 = b;
+        const char *strings = userdata;
+
+        return strcmp(strings + e1->devpath, strings + e2->devpath);
+}
+
+/* Continue with the generation of the file of an earlier instance, so
+ * clients never see the generation going backwards. */
+static uint64_t snapshot_read_generation(const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        Bus1DevicesSnapshotHeader header;
+
+        f = fopen(file, "re");
+        if (!f)
+                return 0;
+
+        if (fread(&header, sizeof(header), 1, f) != 1)
+                return 0;
+
+        if (memcmp(header.signature, BUS1_DEVICES_SNAPSHOT_SIGNATURE, sizeof(header.signature)) != 0)
+                return 0;
+
+        return header.generation;
+}
+
+static int snapshot_save(struct snapshot *snapshot, Bus1DevicesSnapshotHeader *header, const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        _c_cleanup_(c_freep) char *dir = NULL;
+        _c_cleanup_(c_freep) char *tmp = NULL;
+        char *s;
+        int r;
+
+        dir = strdup(file);
+        if (!dir)
+                return -ENOMEM;
+
+        s = strrchr(dir, '/');
+        if (s && s != dir) {
+                *s = '\0';
+                if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+                        return -errno;
+        }
+
+        if (asprintf(&tmp, "%s.tmp", file) < 0)
+                return -ENOMEM;
+
+        f = fopen(tmp, "we");
+        if (!f)
+                return -errno;
+
+        if (fwrite(header, sizeof(*header), 1, f) != 1 ||
+            fwrite(snapshot->entries, sizeof(Bus1DevicesSnapshotEntry), snapshot->n_entries, f) != snapshot->n_entries ||
+            fwrite(snapshot->strings, 1, snapshot->n_strings, f) != snapshot->n_strings ||
+            fflush(f) != 0) {
+                r = -errno ?: -EIO;
+                unlink(tmp);
+                return r;
+        }
+
+        if (rename(tmp, file) < 0) {
+                r = -errno;
+                unlink(tmp);
+                return r;
+        }
+
+        return 0;
+}
+
+/* Write all exposed devices to a new file and replace the old one. */
+int snapshot_write(Manager *m, const char *file) {
+        _c_cleanup_(snapshot_destroy) struct snapshot snapshot = {};
+        Bus1DevicesSnapshotHeader header = {
+                .signature = BUS1_DEVICES_SNAPSHOT_SIGNATURE,
+                .version = BUS1_DEVICES_SNAPSHOT_VERSION,
+                .entry_size = sizeof(Bus1DevicesSnapshotEntry),
+        };
+        uint64_t begin_nsec;
+        uint32_t offset;
+        int r;
+
+        begin_nsec = metrics_now_nsec();
+
+        /* Offset 0 is the empty string. */
+        r = snapshot_add_string(&snapshot, "", &offset);
+        if (r < 0)
+                return r;
+
+        for (struct device *device = device_first(m); device; device = device_next(device)) {
+                if (!device_is_published(device))
+                        continue;
+
+                r = snapshot_add_device(&snapshot, device);
+                if (r < 0)
+                        return r;
+        }
+
+        qsort_r(snapshot.entries, snapshot.n_entries, sizeof(Bus1DevicesSnapshotEntry),
+                snapshot_compare, snapshot.strings);
+
+        if (m->snapshot_generation == 0)
+                m->snapshot_generation = snapshot_read_generation(file);
+
+        header.generation = m->snapshot_generation + 1;
+        header.seqnum = m->seqnum_last;
+        header.n_entries = snapshot.n_entries;
+        header.n_strings = snapshot.n_strings;
+
+        r = snapshot_save(&snapshot, &header, file);
+        if (r < 0)
+                return r;
+
+        m->snapshot_generation = header.generation;
+        m->snapshot_dirty = false;
+        metrics_histogram_add(&m->metrics.snapshot_nsec, metrics_now_nsec() - begin_nsec);
+
+        return 0;
+}
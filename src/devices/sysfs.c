@@ -16,32 +16,10 @@
 ***/
 
 #include <c-macro.h>
+#include <pthread.h>
 #include <string.h>
 #include "sysfs.h"
-
-static ssize_t uevent_get_key_value(char *buf, size_t n_buf, const char **keyp, const char **valuep, char **nextp) {
-        char *end, *value;
-
-        end = strchr(buf, '\n');
-        if (!end)
-                return -EBADMSG;
-
-        *end = '\0';
-        end ++;
-
-        value = strchr(buf, '=');
-        if (!value)
-                return -EBADMSG;
-
-        *value = '\0';
-        value ++;
-
-        *keyp = buf;
-        *valuep = value;
-        *nextp = end;
-
-        return n_buf - (end - buf);
-}
+#include "uevent-parse.h"
 
 static int enumerate_device(int sysfd,
                             const char *sysname,
@@ -60,7 +38,8 @@ static int enumerate_device(int sysfd,
         char *bufp = buf;
         const char *prefix;
         ssize_t len;
-        const char *dp = NULL, *ss = NULL, *dt = NULL, *dn = NULL, *ma = NULL;
+        struct uevent_fields fields;
+        const char *dp = NULL, *ss = NULL;
         int r;
 
         len = readlinkat(sysfd, sysname, buf, buflen);
@@ -117,29 +96,16 @@ static int enumerate_device(int sysfd,
                 }
         }
 
-        while (buflen > 0) {
-                const char *key, *value;
-
-                /* some broken drivers add another newline */
-                if (*bufp == '\n') {
-                        bufp ++;
-                        buflen --;
-                        continue;
-                }
-
-                buflen = uevent_get_key_value(bufp, buflen, &key, &value, &bufp);
-                if (buflen < 0)
-                        return buflen;
-
-                if (strcmp(key, "DEVTYPE") == 0)
-                        dt = value;
-                else if (strcmp(key, "DEVNAME") == 0)
-                        dn = value;
-                else if (strcmp(key, "MODALIAS") == 0)
-                        ma = value;
-        }
+        /* Some broken drivers add another newline, empty lines are skipped. */
+        r = uevent_parse(bufp, buflen, '\n', &fields);
+        if (r < 0)
+                return r;
 
-        r = cb(dp, ss, dt, dn, ma, userdata);
+        r = cb(dp, ss,
+               fields.values[UEVENT_FIELD_DEVTYPE],
+               fields.values[UEVENT_FIELD_DEVNAME],
+               fields.values[UEVENT_FIELD_MODALIAS],
+               userdata);
         if (r < 0 || r == 1)
                 return r;
 
@@ -250,6 +216,279 @@ int sysfs_enumerate(int sysfd,
         return enumerate_subsystems(sysfd, "class", NULL, cb, userdata);
 }
 
+#define SYSFS_THREADS_MAX 16
+#define SYSFS_ARENA_CHUNK_SIZE (64 * 1024)
+
+struct sysfs_record {
+        struct sysfs_record *next;
+        const char *devpath;
+        const char *subsystem;
+        const char *devtype;
+        const char *devname;
+        const char *modalias;
+};
+
+struct sysfs_arena_chunk {
+        struct sysfs_arena_chunk *next;
+        size_t size;
+        size_t used;
+        char data[];
+};
+
+/* Per-thread storage of the enumerated devices, freed in one go. */
+struct sysfs_arena {
+        bool used;
+        struct sysfs_arena_chunk *chunks;
+        struct sysfs_record *first;
+        struct sysfs_record *last;
+};
+
+struct sysfs_enumeration {
+        int busfd;
+        int classfd;
+
+        /* Subsystem names, the ones of /sys/class follow the ones of /sys/bus. */
+        char **subsystems;
+        size_t n_subsystems;
+        size_t n_bus;
+        size_t next;
+
+        struct sysfs_arena arenas[SYSFS_THREADS_MAX];
+        int result;
+};
+
+static void *sysfs_arena_alloc(struct sysfs_arena *arena, size_t size) {
+        struct sysfs_arena_chunk *chunk = arena->chunks;
+        void *p;
+
+        size = (size + 7) & ~(size_t)7;
+
+        if (!chunk || chunk->size - chunk->used < size) {
+                size_t n = c_max(size, (size_t)SYSFS_ARENA_CHUNK_SIZE);
+
+                chunk = malloc(sizeof(*chunk) + n);
+                if (!chunk)
+                        return NULL;
+
+                chunk->next = arena->chunks;
+                chunk->size = n;
+                chunk->used = 0;
+                arena->chunks = chunk;
+        }
+
+        p = chunk->data + chunk->used;
+        chunk->used += size;
+
+        return p;
+}
+
+static void sysfs_arena_destroy(struct sysfs_arena *arena) {
+        while (arena->chunks) {
+                struct sysfs_arena_chunk *chunk = arena->chunks;
+
+                arena->chunks = chunk->next;
+                free(chunk);
+        }
+}
+
+static const char *sysfs_arena_strdup(struct sysfs_arena *arena, const char *s) {
+        size_t n;
+        char *p;
+
+        if (!s)
+                return NULL;
+
+        n = strlen(s) + 1;
+        p = sysfs_arena_alloc(arena, n);
+        if (!p)
+                return NULL;
+
+        return memcpy(p, s, n);
+}
+
+static int sysfs_record_cb(const char *devpath, const char *subsystem,
+                           const char *devtype, const char *devname,
+                           const char *modalias, void *userdata) {
+        struct sysfs_arena *arena = userdata;
+        struct sysfs_record *record;
+
+        record = sysfs_arena_alloc(arena, sizeof(*record));
+        if (!record)
+                return -ENOMEM;
+
+        *record = (struct sysfs_record){
+                .devpath = sysfs_arena_strdup(arena, devpath),
+                .subsystem = sysfs_arena_strdup(arena, subsystem),
+                .devtype = sysfs_arena_strdup(arena, devtype),
+                .devname = sysfs_arena_strdup(arena, devname),
+                .modalias = sysfs_arena_strdup(arena, modalias),
+        };
+
+        if (!record->devpath || !record->subsystem ||
+            (devtype && !record->devtype) ||
+            (devname && !record->devname) ||
+            (modalias && !record->modalias))
+                return -ENOMEM;
+
+        if (arena->last)
+                arena->last->next = record;
+        else
+                arena->first = record;
+        arena->last = record;
+
+        return 0;
+}
+
+static int sysfs_subsystems_add(struct sysfs_enumeration *e, int dfd) {
+        _c_cleanup_(c_closedirp) DIR *dir = NULL;
+
+        dfd = dup(dfd);
+        if (dfd < 0)
+                return -errno;
+
+        dir = fdopendir(dfd);
+        if (!dir) {
+                close(dfd);
+                return -errno;
+        }
+
+        for (struct dirent *d = readdir(dir); d; d = readdir(dir)) {
+                char **subsystems;
+
+                if (d->d_name[0] == '.')
+                        continue;
+
+                subsystems = realloc(e->subsystems, (e->n_subsystems + 1) * sizeof(char *));
+                if (!subsystems)
+                        return -ENOMEM;
+
+                e->subsystems = subsystems;
+                e->subsystems[e->n_subsystems] = strdup(d->d_name);
+                if (!e->subsystems[e->n_subsystems])
+                        return -ENOMEM;
+
+                e->n_subsystems++;
+        }
+
+        return 0;
+}
+
+static void *sysfs_enumerate_thread(void *p) {
+        struct sysfs_enumeration *e = p;
+        struct sysfs_arena *arena;
+        size_t n;
+
+        /* Every thread takes the next free arena. */
+        for (n = 0; n < SYSFS_THREADS_MAX; n++)
+                if (!__atomic_test_and_set(&e->arenas[n].used, __ATOMIC_ACQ_REL))
+                        break;
+        assert(n < SYSFS_THREADS_MAX);
+        arena = &e->arenas[n];
+
+        while (!__atomic_load_n(&e->result, __ATOMIC_RELAXED)) {
+                size_t i;
+                int r;
+
+                i = __atomic_fetch_add(&e->next, 1, __ATOMIC_RELAXED);
+                if (i >= e->n_subsystems)
+                        break;
+
+                if (i < e->n_bus)
+                        r = enumerate_devices(e->busfd, e->subsystems[i], "devices", sysfs_record_cb, arena);
+                else
+                        r = enumerate_devices(e->classfd, e->subsystems[i], NULL, sysfs_record_cb, arena);
+                if (r < 0) {
+                        int expected = 0;
+
+                        __atomic_compare_exchange_n(&e->result, &expected, r, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+                        break;
+                }
+        }
+
+        return NULL;
+}
+
+/* Like sysfs_enumerate(), but the subsystems are read by a pool of threads.
+ * The callback is called from the calling thread after all devices are
+ * read, so the device tree is updated in one go. */
+int sysfs_enumerate_parallel(int sysfd,
+                             int (*cb)(const char *devpath,
+                                       const char *subsystem,
+                                       const char *devtype,
+                                       const char *devname,
+                                       const char *modalias,
+                                       void *userdata),
+                             void *userdata) {
+        struct sysfs_enumeration e = {
+                .busfd = -1,
+                .classfd = -1,
+        };
+        pthread_t threads[SYSFS_THREADS_MAX - 1];
+        size_t n_threads = 0;
+        long n_cpus;
+        int r;
+
+        e.busfd = openat(sysfd, "bus", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
+        if (e.busfd >= 0) {
+                r = sysfs_subsystems_add(&e, e.busfd);
+                if (r < 0)
+                        goto finish;
+        } else if (errno != ENOENT) {
+                r = -errno;
+                goto finish;
+        }
+
+        e.n_bus = e.n_subsystems;
+
+        e.classfd = openat(sysfd, "class", O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
+        if (e.classfd < 0) {
+                r = -errno;
+                goto finish;
+        }
+
+        r = sysfs_subsystems_add(&e, e.classfd);
+        if (r < 0)
+                goto finish;
+
+        n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (; n_threads < c_min((size_t)c_max(n_cpus, 1L) - 1, C_ARRAY_SIZE(threads)); n_threads++)
+                if (pthread_create(&threads[n_threads], NULL, sysfs_enumerate_thread, &e) != 0)
+                        break;
+
+        sysfs_enumerate_thread(&e);
+
+        for (size_t i = 0; i < n_threads; i++)
+                pthread_join(threads[i], NULL);
+
+        r = e.result;
+        if (r < 0)
+                goto finish;
+
+        for (size_t i = 0; i < SYSFS_THREADS_MAX; i++) {
+                for (struct sysfs_record *record = e.arenas[i].first; record; record = record->next) {
+                        r = cb(record->devpath, record->subsystem, record->devtype,
+                               record->devname, record->modalias, userdata);
+                        if (r < 0)
+                                goto finish;
+                        if (r == 1) {
+                                r = 0;
+                                goto finish;
+                        }
+                }
+        }
+
+finish:
+        for (size_t i = 0; i < SYSFS_THREADS_MAX; i++)
+                sysfs_arena_destroy(&e.arenas[i]);
+        for (size_t i = 0; i < e.n_subsystems; i++)
+                free(e.subsystems[i]);
+        free(e.subsystems);
+        c_close(e.classfd);
+        c_close(e.busfd);
+
+        return r;
+}
+
 int sysfs_get_seqnum(int sysfd, uint64_t *seqnump) {
         _c_cleanup_(c_closep) int fd = -1;
         _c_cleanup_(c_fclosep) FILE *f = NULL;
@@ -25,4 +25,13 @@ int sysfs_enumerate(int sysfd,
                               void *userdata),
                     void *userdata);
 
+int sysfs_enumerate_parallel(int sysfd,
+                             int (*cb)(const char *devpath,
+                                       const char *subsystem,
+                                       const char *devtype,
+                                       const char *devname,
+                                       const char *modalias,
+                                       void *userdata),
+                             void *userdata);
+
 int sysfs_get_seqnum(int sysfd, uint64_t *seqnum);
@@ -0,0 +1,122 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <string.h>
+#include "uevent-parse.h"
+
+static const struct {
+        const char *key;
+        size_t n_key;
+} uevent_fields[] = {
+        [UEVENT_FIELD_ACTION] = { "ACTION", 6 },
+        [UEVENT_FIELD_DEVPATH] = { "DEVPATH", 7 },
+        [UEVENT_FIELD_DEVPATH_OLD] = { "DEVPATH_OLD", 11 },
+        [UEVENT_FIELD_SUBSYSTEM] = { "SUBSYSTEM", 9 },
+        [UEVENT_FIELD_DEVTYPE] = { "DEVTYPE", 7 },
+        [UEVENT_FIELD_DEVNAME] = { "DEVNAME", 7 },
+        [UEVENT_FIELD_MODALIAS] = { "MODALIAS", 8 },
+        [UEVENT_FIELD_SEQNUM] = { "SEQNUM", 6 },
+};
+
+/* Pick the only candidate by the length and a distinguishing byte of the key,
+ * a single memcmp() confirms it. */
+static int uevent_field_classify(const char *key, size_t n_key) {
+        int field;
+
+        switch (n_key) {
+        case 6:
+                if (key[0] == 'A')
+                        field = UEVENT_FIELD_ACTION;
+                else if (key[0] == 'S')
+                        field = UEVENT_FIELD_SEQNUM;
+                else
+                        return -1;
+                break;
+        case 7:
+                if (key[0] != 'D')
+                        return -1;
+
+                /* DEVPATH, DEVTYPE, DEVNAME */
+                if (key[3] == 'P')
+                        field = UEVENT_FIELD_DEVPATH;
+                else if (key[3] == 'T')
+                        field = UEVENT_FIELD_DEVTYPE;
+                else if (key[3] == 'N')
+                        field = UEVENT_FIELD_DEVNAME;
+                else
+                        return -1;
+                break;
+        case 8:
+                field = UEVENT_FIELD_MODALIAS;
+                break;
+        case 9:
+                field = UEVENT_FIELD_SUBSYSTEM;
+                break;
+        case 11:
+                field = UEVENT_FIELD_DEVPATH_OLD;
+                break;
+        default:
+                return -1;
+        }
+
+        if (memcmp(key, uevent_fields[field].key, n_key) != 0)
+                return -1;
+
+        return field;
+}
+
+/* Split a list of KEY=value properties, every one terminated by the
+ * separator: '\0' for netlink messages, '\n' for the uevent files in
+ * /sys. The buffer is walked once and modified in place, the keys and
+ * values are null-terminated. Empty entries are skipped, later
+ * properties override earlier ones. */
+int uevent_parse(char *buf, size_t n_buf, char separator, struct uevent_fields *fields) {
+        char *end = buf + n_buf;
+
+        *fields = (struct uevent_fields){};
+
+        while (buf < end) {
+                char *eol, *value;
+                int field;
+
+                eol = memchr(buf, separator, end - buf);
+                if (!eol)
+                        return -EBADMSG;
+
+                if (eol == buf) {
+                        buf++;
+                        continue;
+                }
+
+                value = memchr(buf, '=', eol - buf);
+                if (!value)
+                        return -EBADMSG;
+
+                *eol = '\0';
+
+                field = uevent_field_classify(buf, value - buf);
+                if (field >= 0) {
+                        *value = '\0';
+                        fields->values[field] = value + 1;
+                }
+
+                buf = eol + 1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,37 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* The properties of a uevent we look at, everything else is skipped. */
+enum {
+        UEVENT_FIELD_ACTION,
+        UEVENT_FIELD_DEVPATH,
+        UEVENT_FIELD_DEVPATH_OLD,
+        UEVENT_FIELD_SUBSYSTEM,
+        UEVENT_FIELD_DEVTYPE,
+        UEVENT_FIELD_DEVNAME,
+        UEVENT_FIELD_MODALIAS,
+        UEVENT_FIELD_SEQNUM,
+        _UEVENT_FIELD_N,
+};
+
+/* Values point into the parsed buffer, missing properties are NULL. */
+struct uevent_fields {
+        const char *values[_UEVENT_FIELD_N];
+};
+
+int uevent_parse(char *buf, size_t n_buf, char separator, struct uevent_fields *fields);
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include "device.h"
+#include "metrics.h"
 #include "sysfs.h"
 #include "uevent.h"
 
@@ -28,6 +29,17 @@ enum {
         UEVENT_BROADCAST_KERNEL = 1,
 };
 
+/* The actions we handle, events with other actions are filtered in the
+ * kernel. */
+static const char *uevent_actions[] = {
+        [UEVENT_ACTION_ADD] = "add",
+        [UEVENT_ACTION_CHANGE] = "change",
+        [UEVENT_ACTION_REMOVE] = "remove",
+        [UEVENT_ACTION_MOVE] = "move",
+        [UEVENT_ACTION_ONLINE] = "online",
+        [UEVENT_ACTION_OFFLINE] = "offline",
+};
+
 void uevent_subscription_unlink(struct uevent_subscriptions *uss,
                                 struct uevent_subscription *us) {
 
@@ -139,11 +151,63 @@ int uevent_subscriptions_dispatch_idle(struct uevent_subscriptions *uss) {
         return uevent_subscriptions_dispatch(uss, 0);
 }
 
+/* Generate a socket filter which accepts only messages starting with
+ * "<action>@/devices/" for all actions we handle. The kernel compares the
+ * header of the message in words, a mismatch jumps to the next action. */
+static int uevent_filter_generate(struct sock_filter *filter, size_t n_filter) {
+        size_t n = 0;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(uevent_actions); i++) {
+                char prefix[32];
+                size_t l, start;
+
+                l = snprintf(prefix, sizeof(prefix), "%s@/devices/", uevent_actions[i]);
+                if (l >= sizeof(prefix))
+                        return -EINVAL;
+
+                /* Two instructions per word or byte, and the accept. */
+                if (n + 2 * (l / 4 + l % 4) + 2 > n_filter)
+                        return -E2BIG;
+
+                start = n;
+                for (size_t pos = 0; pos < l;) {
+                        const uint8_t *p = (const uint8_t *)prefix + pos;
+
+                        if (l - pos >= 4) {
+                                filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_W|BPF_ABS, pos);
+                                filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K,
+                                                                           (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3],
+                                                                           0, 0);
+                                pos += 4;
+                        } else {
+                                filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD|BPF_B|BPF_ABS, pos);
+                                filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, p[0], 0, 0);
+                                pos += 1;
+                        }
+                }
+
+                filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffffffff);
+
+                /* On mismatch, skip the rest of this action's block. */
+                for (size_t j = start + 1; j < n; j += 2)
+                        filter[j].jf = n - j - 1;
+        }
+
+        filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0);
+
+        return n;
+}
+
 int uevent_connect(void) {
         int sk;
         struct sockaddr_nl nl = {};
         const int on = 1;
         const int size = 16 * 1024 * 1024;
+        struct sock_filter filter[256];
+        struct sock_fprog fprog = {
+                .filter = filter,
+        };
+        int r;
 
         sk = socket(PF_NETLINK, SOCK_RAW|SOCK_CLOEXEC|SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
         if (sk < 0)
@@ -152,7 +216,18 @@ int uevent_connect(void) {
         if (setsockopt(sk, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0)
                 return -errno;
 
-        if (setsockopt(sk, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        /* Hotplug storms queue a lot of events; SO_RCVBUFFORCE needs
+         * CAP_NET_ADMIN, otherwise we get what rmem_max allows. */
+        if (setsockopt(sk, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0 &&
+            setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+                return -errno;
+
+        r = uevent_filter_generate(filter, C_ARRAY_SIZE(filter));
+        if (r < 0)
+                return r;
+
+        fprog.len = r;
+        if (setsockopt(sk, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
                 return -errno;
 
         nl.nl_family = AF_NETLINK;
@@ -163,31 +238,47 @@ int uevent_connect(void) {
         return sk;
 }
 
+static int uevent_ring_fill(struct uevent_ring *ring, int fd) {
+        int n;
+
+        for (unsigned int i = 0; i < UEVENT_RING_SIZE; i++) {
+                ring->iovs[i] = (struct iovec){
+                        .iov_base = ring->bufs[i],
+                        .iov_len = sizeof(ring->bufs[i]),
+                };
+                ring->msgs[i].msg_hdr = (struct msghdr){
+                        .msg_iov = &ring->iovs[i],
+                        .msg_iovlen = 1,
+                        .msg_control = ring->controls[i],
+                        .msg_controllen = sizeof(ring->controls[i]),
+                        .msg_name = &ring->addrs[i],
+                        .msg_namelen = sizeof(ring->addrs[i]),
+                };
+        }
+
+        n = recvmmsg(fd, ring->msgs, UEVENT_RING_SIZE, MSG_DONTWAIT, NULL);
+        if (n < 0)
+                return -errno;
+
+        ring->n_msgs = n;
+        ring->next = 0;
+
+        return n;
+}
+
+/* Returns -ENOBUFS if uevents were lost, the caller needs to resync with
+ * /sys. */
 int uevent_receive(Manager *m, struct device **devicep, int *actionp, uint64_t *seqnump) {
+        struct uevent_ring *ring = &m->uevent_ring;
         struct device *device;
-        char buf[4096];
+        struct msghdr *smsg;
+        struct sockaddr_nl *nl;
+        char *buf;
         ssize_t buflen;
-        struct iovec iov = {
-                .iov_base = buf,
-                .iov_len = sizeof(buf),
-        };
-        char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
-        struct sockaddr_nl nl = {
-                .nl_family = AF_NETLINK,
-                .nl_groups = UEVENT_BROADCAST_KERNEL,
-        };
-        struct msghdr smsg = {
-                .msg_iov = &iov,
-                .msg_iovlen = 1,
-                .msg_control = cred_msg,
-                .msg_controllen = sizeof(cred_msg),
-                .msg_name = &nl,
-                .msg_namelen = sizeof(nl),
-        };
         struct cmsghdr *cmsg;
         struct ucred *cred;
         char *payload;
-        uint64_t seqnum;
+        uint64_t seqnum, begin_nsec;
         int r, action;
 
         assert(m);
@@ -195,20 +286,35 @@ int uevent_receive(Manager *m, struct device **devicep, int *actionp, uint64_t *
         assert(actionp);
         assert(seqnump);
 
-        buflen = recvmsg(m->fd_uevent, &smsg, 0);
-        if (buflen < 0)
-                return -errno;
-        else if (buflen < 32 || (smsg.msg_flags & MSG_TRUNC))
-                /* XXX: handle ENOBUFS? */
+        if (ring->next >= ring->n_msgs) {
+                r = uevent_ring_fill(ring, m->fd_uevent);
+                if (r < 0)
+                        return r;
+
+                if (r == 0)
+                        return -EAGAIN;
+        }
+
+        smsg = &ring->msgs[ring->next].msg_hdr;
+        buf = ring->bufs[ring->next];
+        buflen = ring->msgs[ring->next].msg_len;
+        nl = &ring->addrs[ring->next];
+        ring->next++;
+
+        /* A truncated event is as good as a lost one. */
+        if (smsg->msg_flags & MSG_TRUNC)
+                return -ENOBUFS;
+
+        if (buflen < 32)
                 return -EBADMSG;
 
-        if (nl.nl_groups != UEVENT_BROADCAST_KERNEL)
+        if (nl->nl_groups != UEVENT_BROADCAST_KERNEL)
                 return -EIO;
 
-        if (nl.nl_pid > 0)
+        if (nl->nl_pid > 0)
                 return -EIO;
 
-        cmsg = CMSG_FIRSTHDR(&smsg);
+        cmsg = CMSG_FIRSTHDR(smsg);
         if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS)
                 return -EBADMSG;
 
@@ -231,7 +337,16 @@ int uevent_receive(Manager *m, struct device **devicep, int *actionp, uint64_t *
 
         /* Pass null-delimited key-value pairs, guaranteed to be
          * null-terminated. */
+        begin_nsec = metrics_now_nsec();
+        m->metrics.n_uevents++;
+
         r = device_from_nulstr(m, &device, &action, &seqnum, payload, buflen);
+
+        metrics_histogram_add(&m->metrics.uevent_nsec, metrics_now_nsec() - begin_nsec);
+        if (r < 0)
+                m->metrics.n_uevents_failed++;
+        else if (r == 0)
+                m->metrics.n_uevents_ignored++;
         if (r <= 0)
                 return r;
 
@@ -241,21 +356,18 @@ int uevent_receive(Manager *m, struct device **devicep, int *actionp, uint64_t *
         return 1;
 }
 
+const char *uevent_action_to_string(int action) {
+        assert(action >= 0 && action < _UEVENT_ACTION_N);
+
+        return uevent_actions[action];
+}
+
 int uevent_action_from_string(const char *action) {
         assert(action);
 
-        if (strcmp(action, "change") == 0)
-                return UEVENT_ACTION_CHANGE;
-        else if (strcmp(action, "add") == 0)
-                return UEVENT_ACTION_ADD;
-        else if (strcmp(action, "remove") == 0)
-                return UEVENT_ACTION_REMOVE;
-        else if (strcmp(action, "move") == 0)
-                return UEVENT_ACTION_MOVE;
-        else if (strcmp(action, "online") == 0)
-                return UEVENT_ACTION_ONLINE;
-        else if (strcmp(action, "offline") == 0)
-                return UEVENT_ACTION_OFFLINE;
+        for (size_t i = 0; i < C_ARRAY_SIZE(uevent_actions); i++)
+                if (strcmp(action, uevent_actions[i]) == 0)
+                        return i;
 
         return -EBADMSG;
 }
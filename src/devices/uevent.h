@@ -16,6 +16,9 @@
   along with bus1; If not, see <http://www.gnu.org/licenses/>.
 ***/
 
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
 enum {
         UEVENT_ACTION_ADD,
         UEVENT_ACTION_CHANGE,
@@ -23,6 +26,7 @@ enum {
         UEVENT_ACTION_MOVE,
         UEVENT_ACTION_ONLINE,
         UEVENT_ACTION_OFFLINE,
+        _UEVENT_ACTION_N,
 };
 
 typedef struct Manager Manager;
@@ -40,6 +44,20 @@ struct uevent_subscriptions {
         CList list;
 };
 
+#define UEVENT_RING_SIZE 32
+#define UEVENT_BUFFER_SIZE 8192
+
+/* Messages received with a single recvmmsg() call and not yet parsed. */
+struct uevent_ring {
+        struct mmsghdr msgs[UEVENT_RING_SIZE];
+        struct iovec iovs[UEVENT_RING_SIZE];
+        struct sockaddr_nl addrs[UEVENT_RING_SIZE];
+        uint8_t controls[UEVENT_RING_SIZE][CMSG_SPACE(sizeof(struct ucred))];
+        char bufs[UEVENT_RING_SIZE][UEVENT_BUFFER_SIZE];
+        unsigned int n_msgs;
+        unsigned int next;
+};
+
 void uevent_subscription_unlink(struct uevent_subscriptions *uss,
                                 struct uevent_subscription *us);
 void uevent_subscription_destroy(struct uevent_subscription *us);
@@ -60,3 +78,4 @@ int uevent_connect(void);
 int uevent_receive(Manager *m, struct device **devicep, int *actionp, uint64_t *seqnum);
 
 int uevent_action_from_string(const char *action);
+const char *uevent_action_to_string(int action);
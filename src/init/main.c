@@ -31,6 +31,7 @@
 #include "shared/mount.h"
 #include "shared/process.h"
 #include "shared/kernel-cmdline.h"
+#include "shared/trace.h"
 
 static bool string_has_option(const char *options, const char *option) {
         const char *s;
@@ -457,8 +458,15 @@ int main(int argc, char **argv) {
         };
         _c_cleanup_(c_fclosep) FILE *log = NULL;
         _c_cleanup_(manager_freep) Manager *m = NULL;
+        int span, span_services;
         int r;
 
+        /* Continue the timeline of the initrd. */
+        if (trace_load(TRACE_RDINIT_FILE) >= 0)
+                unlink(TRACE_RDINIT_FILE);
+
+        span = trace_begin("init-startup");
+
         /* install dump process handler */
         if (sigaction(SIGSEGV, &sa, NULL) < 0 ||
             sigaction(SIGILL, &sa, NULL) < 0 ||
@@ -494,12 +502,26 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto fail;
 
+        span_services = trace_begin("start-services");
         r = manager_start_services(m, -1);
+        trace_end(span_services);
         if (r < 0)
                 goto fail;
 
-        if (m->boot_counter >= 0 && loader_reset_boot_counter(m) < 0)
-                goto fail;
+        if (m->boot_counter >= 0) {
+                int span_counter;
+
+                span_counter = trace_begin("reset-boot-counter");
+                r = loader_reset_boot_counter(m);
+                trace_end(span_counter);
+                if (r < 0)
+                        goto fail;
+        }
+
+        trace_end(span);
+        r = trace_write_timeline(TRACE_TIMELINE_FILE);
+        if (r < 0)
+                kmsg(LOG_WARNING, "Unable to write boot timeline %s: %s.", TRACE_TIMELINE_FILE, strerror(-r));
 
         r = manager_run(m);
         if (r < 0)
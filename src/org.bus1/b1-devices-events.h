@@ -0,0 +1,77 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/*
+
+  Device events of org.bus1.devices, delivered over a SOCK_SEQPACKET
+  socket.
+
+  A client connects and sends any number of filter messages, every
+  one a Bus1DevicesEventFilter. An event is delivered if it matches any
+  of the filters; a client without filters receives all events. Filters
+  apply to the events after they have been received by the server.
+
+  Every message from the server is one event: a Bus1DevicesEvent
+  followed by the NUL terminated strings of the event, in the order of
+  their sizes in the header. A size of 0 marks an unset string. The
+  devpaths are relative to /sys/devices.
+
+  Events are sent after they have been applied to the device tree,
+  batched at the end of every burst of uevents. Once all uevents which
+  happened before the connection are processed, a SETTLED event is sent;
+  from then on the device snapshot and the events are consistent.
+
+  A client which does not read its events fast enough is disconnected.
+
+  The byte-order is the one of the host.
+
+  The directory of the socket is shared with the host by
+  org.bus1.activator, like the one of the device snapshot.
+
+ */
+
+#define BUS1_DEVICES_EVENTS_SOCKET      "/run/org.bus1.devices/events"
+#define BUS1_DEVICES_EVENTS_FILTERS_MAX 16
+
+enum {
+        BUS1_DEVICES_ACTION_ADD,
+        BUS1_DEVICES_ACTION_CHANGE,
+        BUS1_DEVICES_ACTION_REMOVE,
+        BUS1_DEVICES_ACTION_MOVE,
+        BUS1_DEVICES_ACTION_ONLINE,
+        BUS1_DEVICES_ACTION_OFFLINE,
+        BUS1_DEVICES_ACTION_SETTLED,            /* No device, only the seqnum. */
+};
+
+typedef struct {
+        uint32_t actions;                       /* Mask of 1 << BUS1_DEVICES_ACTION_*, 0 matches all. */
+        char subsystem[64];                     /* Empty matches all. */
+        char devtype[64];                       /* Empty matches all. */
+        char devname[128];                      /* fnmatch() pattern, empty matches all. */
+} Bus1DevicesEventFilter;
+
+typedef struct {
+        uint64_t seqnum;
+        uint32_t action;                        /* BUS1_DEVICES_ACTION_* */
+        uint16_t n_devpath;
+        uint16_t n_devpath_old;                 /* Only for MOVE. */
+        uint16_t n_subsystem;
+        uint16_t n_devtype;
+        uint16_t n_devname;
+        uint16_t n_modalias;
+} Bus1DevicesEvent;
@@ -0,0 +1,122 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/*
+
+  Read-only snapshot of the device tree of org.bus1.devices.
+
+  ┌──────────────────────────────────────────┐
+  │ Header                                   │
+  ├──────────────────────────────────────────┤
+  │ Entries, sorted by devpath (strcmp)      │
+  ├──────────────────────────────────────────┤
+  │ Strings, NUL terminated                  │
+  └──────────────────────────────────────────┘
+
+  The file is replaced atomically after every batch of uevents which
+  changed the tree; an existing mapping stays valid and unchanged. The
+  generation increases with every new snapshot, clients re-open the file
+  to see a newer one.
+
+  The strings of an entry are offsets into the string table, 0 is the
+  empty string and marks an unset value. The devpath is relative to
+  /sys/devices.
+
+  The byte-order is the one of the host.
+
+  The directory of the file is bound into the private root of the service
+  by org.bus1.activator and is visible at the same path on the host.
+
+ */
+
+#include <string.h>
+
+#define BUS1_DEVICES_SNAPSHOT_FILE      "/run/org.bus1.devices/devices"
+#define BUS1_DEVICES_SNAPSHOT_SIGNATURE "B1DEVDB"
+#define BUS1_DEVICES_SNAPSHOT_VERSION   1
+
+typedef struct {
+        char signature[8];                      /* BUS1_DEVICES_SNAPSHOT_SIGNATURE */
+        uint32_t version;                       /* BUS1_DEVICES_SNAPSHOT_VERSION */
+        uint32_t entry_size;                    /* Size of an entry in bytes. */
+        uint64_t generation;                    /* Increased with every snapshot. */
+        uint64_t seqnum;                        /* Last uevent included in the snapshot. */
+        uint32_t n_entries;                     /* Number of entries. */
+        uint32_t n_strings;                     /* Size of the string table in bytes. */
+} Bus1DevicesSnapshotHeader;
+
+typedef struct {
+        uint32_t devpath;
+        uint32_t subsystem;
+        uint32_t devtype;
+        uint32_t devname;
+        uint32_t modalias;
+} Bus1DevicesSnapshotEntry;
+
+/* Validate a mapped snapshot, returns its header or NULL. */
+static inline const Bus1DevicesSnapshotHeader *bus1_devices_snapshot_header(const void *map, size_t n_map) {
+        const Bus1DevicesSnapshotHeader *header = map;
+
+        if (n_map < sizeof(*header))
+                return NULL;
+
+        if (memcmp(header->signature, BUS1_DEVICES_SNAPSHOT_SIGNATURE, sizeof(header->signature)) != 0 ||
+            header->version != BUS1_DEVICES_SNAPSHOT_VERSION ||
+            header->entry_size != sizeof(Bus1DevicesSnapshotEntry))
+                return NULL;
+
+        if ((uint64_t)header->n_entries * header->entry_size + header->n_strings > n_map - sizeof(*header))
+                return NULL;
+
+        /* The last string is terminated. */
+        if (header->n_strings == 0 ||
+            ((const char *)(header + 1))[(size_t)header->n_entries * header->entry_size + header->n_strings - 1] != '\0')
+                return NULL;
+
+        return header;
+}
+
+static inline const char *bus1_devices_snapshot_string(const void *map, uint32_t offset) {
+        const Bus1DevicesSnapshotHeader *header = map;
+        const char *strings = (const char *)map + sizeof(*header) + (size_t)header->n_entries * header->entry_size;
+
+        return offset > 0 && offset < header->n_strings ? strings + offset : NULL;
+}
+
+/* Binary search for a devpath in a validated snapshot. */
+static inline const Bus1DevicesSnapshotEntry *bus1_devices_snapshot_lookup(const void *map, const char *devpath) {
+        const Bus1DevicesSnapshotHeader *header = map;
+        const Bus1DevicesSnapshotEntry *entries = (const void *)(header + 1);
+        size_t l = 0, r = header->n_entries;
+
+        while (l < r) {
+                size_t i = l + (r - l) / 2;
+                const char *s = bus1_devices_snapshot_string(map, entries[i].devpath);
+                int k;
+
+                k = strcmp(devpath, s ?: "");
+                if (k == 0)
+                        return &entries[i];
+                else if (k < 0)
+                        r = i;
+                else
+                        l = i + 1;
+        }
+
+        return NULL;
+}
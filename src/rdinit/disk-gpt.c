@@ -20,8 +20,12 @@
 #include <byteswap.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <org.bus1/b1-platform.h>
+#include <pthread.h>
 #include <string.h>
+#include "shared/crc32.h"
+#include "shared/kmsg.h"
 #include "shared/uuid.h"
 #include "disk-gpt.h"
 
@@ -69,80 +73,231 @@ static uint8_t *guid_to_uuid(const struct guid *guid, uint8_t *uuid) {
         return uuid;
 }
 
+/* Primary header at LBA 1 and the default-sized entry array. */
+#define GPT_PROBE_ENTRIES_SIZE (128 * 128)
+
+static int gpt_read(int fd, uint64_t offset, size_t size, void **bufp) {
+        _c_cleanup_(c_freep) void *buf = NULL;
+        ssize_t n;
+
+        if (posix_memalign(&buf, 4096, size) != 0)
+                return -ENOMEM;
+
+        n = pread(fd, buf, size, offset);
+        if (n < 0)
+                return -errno;
+
+        if ((size_t)n != size)
+                return -EIO;
+
+        *bufp = buf;
+        buf = NULL;
+
+        return 0;
+}
+
+static int gpt_header_validate(const struct gpt_header *header, uint64_t lba, unsigned int sector_size) {
+        uint8_t buf[4096];
+        uint32_t header_size;
+        uint32_t crc;
+        unsigned int entry_size;
+
+        if (memcmp(header->signature, "EFI PART", sizeof(header->signature)) != 0)
+                return -EINVAL;
+
+        header_size = le32toh(header->header_size);
+        if (header_size < sizeof(struct gpt_header) || header_size > sector_size || header_size > sizeof(buf))
+                return -EINVAL;
+
+        /* The checksum is calculated with the checksum field zeroed. */
+        memcpy(buf, header, header_size);
+        memset(buf + offsetof(struct gpt_header, header_crc32), 0, sizeof(uint32_t));
+        memcpy(&crc, (const uint8_t *)header + offsetof(struct gpt_header, header_crc32), sizeof(crc));
+        if (crc32_update(0, buf, header_size) != le32toh(crc))
+                return -EBADMSG;
+
+        if (le64toh(header->my_lba) != lba)
+                return -EINVAL;
+
+        if (le32toh(header->n_partition_entries) > 1024)
+                return -EINVAL;
+
+        entry_size = le32toh(header->partition_entry_size);
+        if (entry_size == 0 || entry_size > 1024 || entry_size % 128)
+                return -EINVAL;
+
+        return 0;
+}
+
+/* The size of a block device, or of a disk image. */
+static int gpt_disk_size(int fd, uint64_t *sizep) {
+        struct stat st;
+
+        if (ioctl(fd, BLKGETSIZE64, sizep) >= 0)
+                return 0;
+
+        if (fstat(fd, &st) < 0)
+                return -errno;
+
+        if (!S_ISREG(st.st_mode))
+                return -ENOTBLK;
+
+        *sizep = st.st_size;
+
+        return 0;
+}
+
+/* Return the validated partition entries of a header, they are taken from
+ * the already read buffer if they are part of it. */
+static int gpt_entries_read(int fd,
+                            const struct gpt_header *header,
+                            unsigned int sector_size,
+                            const uint8_t *probe,
+                            size_t probe_size,
+                            const uint8_t **entriesp,
+                            void **entries_allocp) {
+        _c_cleanup_(c_freep) void *entries_alloc = NULL;
+        const uint8_t *entries;
+        uint64_t disk_size;
+        uint64_t offset;
+        size_t size;
+        int r;
+
+        r = gpt_disk_size(fd, &disk_size);
+        if (r < 0)
+                return r;
+
+        /* The entries are untrusted, they must be on the disk. */
+        if (le64toh(header->partition_entries_lba) >= disk_size / sector_size)
+                return -EINVAL;
+
+        offset = le64toh(header->partition_entries_lba) * sector_size;
+        size = le32toh(header->n_partition_entries) * le32toh(header->partition_entry_size);
+        if (size > disk_size - offset)
+                return -EINVAL;
+
+        if (size <= probe_size && offset <= probe_size - size)
+                entries = probe + offset;
+        else {
+                r = gpt_read(fd, offset, size, &entries_alloc);
+                if (r < 0)
+                        return r;
+
+                entries = entries_alloc;
+        }
+
+        if (crc32_update(0, entries, size) != le32toh(header->partition_entry_array_crc32))
+                return -EBADMSG;
+
+        *entriesp = entries;
+        *entries_allocp = entries_alloc;
+        entries_alloc = NULL;
+
+        return 0;
+}
+
+/* Read and validate the backup header in the last LBA of the disk. */
+static int gpt_backup_read(int fd, unsigned int sector_size, struct gpt_header *headerp) {
+        _c_cleanup_(c_freep) void *buf = NULL;
+        uint64_t size;
+        uint64_t lba;
+        int r;
+
+        r = gpt_disk_size(fd, &size);
+        if (r < 0)
+                return r;
+
+        if (size < 67 * sector_size)
+                return -EINVAL;
+
+        lba = size / sector_size - 1;
+        r = gpt_read(fd, lba * sector_size, sector_size, &buf);
+        if (r < 0)
+                return r;
+
+        r = gpt_header_validate(buf, lba, sector_size);
+        if (r < 0)
+                return r;
+
+        memcpy(headerp, buf, sizeof(struct gpt_header));
+
+        return 0;
+}
+
 int disk_gpt_find_partitions(const char *device,
                              const uint8_t *disk_uuid,
                              char **device_bootp,
                              char **device_datap) {
-        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        _c_cleanup_(c_closep) int fd = -1;
         int sector_size;
+        _c_cleanup_(c_freep) void *probe = NULL;
+        size_t probe_size;
+        const struct gpt_header *primary;
         struct gpt_header header;
         uint8_t uuid[16];
-        uint64_t entries_lba;
         unsigned int n_entries;
         unsigned int entry_size;
         static const uint8_t uuid_data[] = BUS1_GPT_TYPE_DATA_UUID;
         static const uint8_t uuid_boot[] = BUS1_GPT_TYPE_BOOT_UUID;
-        _c_cleanup_(c_freep) void *entries = NULL;
-        struct gpt_entry *entry;
+        _c_cleanup_(c_freep) void *entries_alloc = NULL;
+        const uint8_t *entries;
+        const struct gpt_entry *entry;
         unsigned int boot_partno = 0;
         unsigned int data_partno = 0;
         _c_cleanup_(c_freep) char *device_boot = NULL;
         _c_cleanup_(c_freep) char *device_data = NULL;
+        int r;
 
-        f = fopen(device, "re");
-        if (!f)
+        fd = open(device, O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
                 return -errno;
 
-        setvbuf(f, NULL, _IONBF, 0);
-
-        if (ioctl(fileno(f), BLKSSZGET, &sector_size) < 0)
+        if (ioctl(fd, BLKSSZGET, &sector_size) < 0 || sector_size < 512 || sector_size > 4096)
                 sector_size = 512;
 
-        /* Read header. */
-        if (fseeko(f, 1 * sector_size, SEEK_SET) < 0)
-                return -errno;
-
-        if (fread(&header, sizeof(header), 1, f) != 1)
-                return -EIO;
-
-        if (memcmp(header.signature, "EFI PART", sizeof(header.signature)) != 0)
-                return -EINVAL;
-
-        if (le32toh(header.header_size) < 92)
-                return -EINVAL;
-
-        if (le64toh(header.my_lba) != 1)
-                return -EINVAL;
+        /* Read the protective MBR, the primary header and the default
+         * partition entry array with a single I/O. */
+        probe_size = 2 * sector_size + GPT_PROBE_ENTRIES_SIZE;
+        r = gpt_read(fd, 0, probe_size, &probe);
+        if (r < 0)
+                return r;
+
+        /* The checksum covers the whole header_size, validate it in the
+         * sector buffer. */
+        primary = (const struct gpt_header *)((const uint8_t *)probe + sector_size);
+        memcpy(&header, primary, sizeof(header));
+        r = gpt_header_validate(primary, 1, sector_size);
+        if (r >= 0)
+                r = gpt_entries_read(fd, &header, sector_size, probe, probe_size, &entries, &entries_alloc);
+        if (r < 0) {
+                int k;
+
+                /* Not a GPT disk at all. */
+                if (r == -EINVAL && memcmp(primary->signature, "EFI PART", sizeof(primary->signature)) != 0)
+                        return r;
+
+                /* Fall back to the backup header at the end of the disk. */
+                k = gpt_backup_read(fd, sector_size, &header);
+                if (k < 0)
+                        return r;
+
+                r = gpt_entries_read(fd, &header, sector_size, probe, probe_size, &entries, &entries_alloc);
+                if (r < 0)
+                        return r;
+
+                if (memcmp(guid_to_uuid(&header.disk_guid, uuid), disk_uuid, sizeof(uuid)) == 0)
+                        kmsg(LOG_WARNING, "Primary GPT of %s is invalid, using the backup GPT.", device);
+        }
 
         /* Check if we found the disk we are looking for. */
         if (memcmp(guid_to_uuid(&header.disk_guid, uuid), disk_uuid, sizeof(uuid)) != 0)
                 return -EINVAL;
 
-        /* Read partition entries array. */
-        entries_lba = le64toh(header.partition_entries_lba);
-        if (entries_lba != 2)
-                return -EINVAL;
-
         n_entries = le32toh(header.n_partition_entries);
-        if (n_entries > 1024)
-                return -EINVAL;
-
         entry_size = le32toh(header.partition_entry_size);
-        if (entry_size > 1024 || entry_size % 128)
-                return -EINVAL;
-
-        entries = malloc(n_entries * entry_size);
-        if (!entries)
-                return -ENOMEM;
-
-        if (fseeko(f, entries_lba * sector_size, SEEK_SET) < 0)
-                return -errno;
-
-        if (fread(entries, entry_size, n_entries, f) != n_entries)
-                return -EIO;
 
         /* Search boot and data partition types. */
-        entry = entries;
+        entry = (const struct gpt_entry *)entries;
         for (unsigned int i = 1; i <= n_entries; i++) {
                 guid_to_uuid(&entry->partition_type_guid, uuid);
 
@@ -154,7 +309,7 @@ int disk_gpt_find_partitions(const char *device,
                 if (boot_partno > 0 && data_partno > 0)
                         break;
 
-                entry = (struct gpt_entry *)((uint8_t *)entry + entry_size);
+                entry = (const struct gpt_entry *)((const uint8_t *)entry + entry_size);
         }
 
         if (boot_partno == 0 || data_partno == 0)
@@ -187,3 +342,187 @@ int disk_gpt_find_partitions(const char *device,
 
         return 0;
 }
+
+#define GPT_PROBE_THREADS_MAX 16
+
+/* Shared with the detached workers, the last reference frees it. */
+struct gpt_probe {
+        unsigned int n_refs;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+
+        char **devices;
+        size_t n_devices;
+        uint8_t disk_uuid[16];
+
+        size_t next;
+        size_t n_probed;
+        bool found;
+
+        /* The first matching device. */
+        size_t match;
+        char *device_boot;
+        char *device_data;
+};
+
+static struct gpt_probe *gpt_probe_unref(struct gpt_probe *probe) {
+        if (!probe || __atomic_sub_fetch(&probe->n_refs, 1, __ATOMIC_ACQ_REL) > 0)
+                return NULL;
+
+        for (size_t i = 0; i < probe->n_devices; i++)
+                free(probe->devices[i]);
+        free(probe->devices);
+        free(probe->device_boot);
+        free(probe->device_data);
+        pthread_cond_destroy(&probe->cond);
+        pthread_mutex_destroy(&probe->lock);
+        free(probe);
+
+        return NULL;
+}
+
+C_DEFINE_CLEANUP(struct gpt_probe *, gpt_probe_unref);
+
+static int gpt_probe_new(struct gpt_probe **probep, char **devices, size_t n_devices, const uint8_t *disk_uuid) {
+        _c_cleanup_(gpt_probe_unrefp) struct gpt_probe *probe = NULL;
+
+        probe = calloc(1, sizeof(struct gpt_probe));
+        if (!probe)
+                return -ENOMEM;
+
+        probe->n_refs = 1;
+        pthread_mutex_init(&probe->lock, NULL);
+        pthread_cond_init(&probe->cond, NULL);
+        memcpy(probe->disk_uuid, disk_uuid, sizeof(probe->disk_uuid));
+
+        /* The workers might outlive the caller's array. */
+        probe->devices = calloc(n_devices, sizeof(char *));
+        if (!probe->devices)
+                return -ENOMEM;
+
+        for (; probe->n_devices < n_devices; probe->n_devices++) {
+                probe->devices[probe->n_devices] = strdup(devices[probe->n_devices]);
+                if (!probe->devices[probe->n_devices])
+                        return -ENOMEM;
+        }
+
+        *probep = probe;
+        probe = NULL;
+
+        return 0;
+}
+
+static void *gpt_probe_thread(void *p) {
+        struct gpt_probe *probe = p;
+
+        for (;;) {
+                _c_cleanup_(c_freep) char *device_boot = NULL;
+                _c_cleanup_(c_freep) char *device_data = NULL;
+                size_t i;
+                int r;
+
+                pthread_mutex_lock(&probe->lock);
+                if (probe->found || probe->next >= probe->n_devices) {
+                        pthread_mutex_unlock(&probe->lock);
+                        break;
+                }
+                i = probe->next++;
+                pthread_mutex_unlock(&probe->lock);
+
+                r = disk_gpt_find_partitions(probe->devices[i], probe->disk_uuid, &device_boot, &device_data);
+
+                pthread_mutex_lock(&probe->lock);
+                probe->n_probed++;
+
+                /* Two disks with the same UUID; the first one wins. */
+                if (r >= 0 && !probe->found) {
+                        probe->found = true;
+                        probe->match = i;
+                        probe->device_boot = device_boot;
+                        probe->device_data = device_data;
+                        device_boot = NULL;
+                        device_data = NULL;
+                }
+
+                if (probe->found || probe->n_probed == probe->n_devices)
+                        pthread_cond_broadcast(&probe->cond);
+                pthread_mutex_unlock(&probe->lock);
+        }
+
+        gpt_probe_unref(probe);
+
+        return NULL;
+}
+
+/* Probe several disks concurrently and return as soon as one of them
+ * matches; a slow disk does not delay the others, its worker finishes in
+ * the background. Returns the index of the matching device. */
+int disk_gpt_find_disk(char **devices,
+                       size_t n_devices,
+                       const uint8_t *disk_uuid,
+                       char **device_bootp,
+                       char **device_datap) {
+        _c_cleanup_(gpt_probe_unrefp) struct gpt_probe *probe = NULL;
+        pthread_attr_t attr;
+        size_t n_threads = 0;
+        int r;
+
+        if (n_devices == 0)
+                return -ENODEV;
+
+        /* Spawning threads is not worth it for the common single disk. */
+        if (n_devices == 1) {
+                r = disk_gpt_find_partitions(devices[0], disk_uuid, device_bootp, device_datap);
+                if (r < 0)
+                        return -ENODEV;
+
+                return 0;
+        }
+
+        r = gpt_probe_new(&probe, devices, n_devices, disk_uuid);
+        if (r < 0)
+                return r;
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        for (; n_threads < c_min(n_devices, (size_t)GPT_PROBE_THREADS_MAX); n_threads++) {
+                pthread_t thread;
+
+                __atomic_add_fetch(&probe->n_refs, 1, __ATOMIC_RELAXED);
+                if (pthread_create(&thread, &attr, gpt_probe_thread, probe) != 0) {
+                        __atomic_sub_fetch(&probe->n_refs, 1, __ATOMIC_RELAXED);
+                        break;
+                }
+        }
+
+        pthread_attr_destroy(&attr);
+
+        /* Without any worker, probe in this thread. */
+        if (n_threads == 0) {
+                __atomic_add_fetch(&probe->n_refs, 1, __ATOMIC_RELAXED);
+                gpt_probe_thread(probe);
+        }
+
+        pthread_mutex_lock(&probe->lock);
+        while (!probe->found && probe->n_probed < probe->n_devices)
+                pthread_cond_wait(&probe->cond, &probe->lock);
+
+        if (probe->found) {
+                r = probe->match;
+
+                if (device_bootp) {
+                        *device_bootp = probe->device_boot;
+                        probe->device_boot = NULL;
+                }
+
+                if (device_datap) {
+                        *device_datap = probe->device_data;
+                        probe->device_data = NULL;
+                }
+        } else
+                r = -ENODEV;
+        pthread_mutex_unlock(&probe->lock);
+
+        return r;
+}
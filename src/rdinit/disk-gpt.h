@@ -20,3 +20,9 @@ int disk_gpt_find_partitions(const char *device,
                              const uint8_t *disk_uuid,
                              char **device_bootp,
                              char **device_datap);
+
+int disk_gpt_find_disk(char **devices,
+                       size_t n_devices,
+                       const uint8_t *disk_uuid,
+                       char **device_bootp,
+                       char **device_datap);
@@ -0,0 +1,186 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <c-usec.h>
+#include <pthread.h>
+#include <string.h>
+#include "shared/kmsg.h"
+#include "job.h"
+
+enum {
+        JOB_PENDING,
+        JOB_RUNNING,
+        JOB_DONE,               /* The job thread has finished. */
+        JOB_SKIPPED,            /* The job was never started. */
+};
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+
+static void *job_thread(void *p) {
+        Job *job = p;
+        int r;
+
+        r = job->func(job->userdata);
+
+        pthread_mutex_lock(&job_lock);
+        job->result = r;
+        job->end_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+        job->state = JOB_DONE;
+        pthread_cond_broadcast(&job_cond);
+        pthread_mutex_unlock(&job_lock);
+
+        return NULL;
+}
+
+/* Returns 1 if the job can be started, 0 if it needs to wait, or a negative
+ * error code if one of its dependencies has failed. */
+static int job_ready(Job *job) {
+        job->blocked_by = NULL;
+
+        for (size_t i = 0; i < JOB_AFTER_MAX && job->after[i]; i++) {
+                Job *dep = job->after[i];
+
+                if (dep->state < JOB_DONE)
+                        return 0;
+
+                if (dep->result < 0)
+                        return -ECANCELED;
+
+                if (!job->blocked_by || dep->end_usec > job->blocked_by->end_usec)
+                        job->blocked_by = dep;
+        }
+
+        return 1;
+}
+
+static void job_log(Job *job, uint64_t start_usec) {
+        Job *chain[16];
+        size_t n_chain = 0;
+        char path[256] = {};
+        size_t n_path = 0;
+
+        if (job->result < 0) {
+                kmsg(LOG_ERR, "Job %s failed: %s.", job->name, strerror(-job->result));
+                return;
+        }
+
+        /* Follow the dependencies which delayed the start of the job. */
+        for (Job *j = job; j && n_chain < C_ARRAY_SIZE(chain); j = j->blocked_by)
+                chain[n_chain++] = j;
+
+        for (size_t i = n_chain; i > 0 && n_path < sizeof(path); i--)
+                n_path += snprintf(path + n_path, sizeof(path) - n_path, "%s%s",
+                                   chain[i - 1]->name, i > 1 ? " -> " : "");
+
+        kmsg(LOG_INFO, "Job %s finished after %" PRIu64 " ms (+%" PRIu64 " ms), critical path %s (%" PRIu64 " ms).",
+             job->name,
+             (job->end_usec - job->start_usec) / 1000,
+             (job->end_usec - start_usec) / 1000,
+             path,
+             (job->end_usec - chain[n_chain - 1]->start_usec) / 1000);
+}
+
+/* Run a set of jobs with dependencies between each other; every job is
+ * executed in its own thread as soon as all jobs in its after[] list have
+ * finished successfully. Returns the first error of all jobs. */
+int jobs_run(Job **jobs, size_t n_jobs) {
+        uint64_t start_usec;
+        int r = 0;
+
+        start_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+
+        for (size_t i = 0; i < n_jobs; i++) {
+                jobs[i]->state = JOB_PENDING;
+                jobs[i]->result = 0;
+                jobs[i]->blocked_by = NULL;
+        }
+
+        pthread_mutex_lock(&job_lock);
+        for (;;) {
+                size_t n_finished = 0;
+                size_t n_running = 0;
+                bool progress = false;
+
+                for (size_t i = 0; i < n_jobs; i++) {
+                        Job *job = jobs[i];
+                        int k;
+
+                        if (job->state != JOB_PENDING)
+                                continue;
+
+                        k = job_ready(job);
+                        if (k == 0)
+                                continue;
+
+                        job->start_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+
+                        if (k > 0) {
+                                k = -pthread_create(&job->thread, NULL, job_thread, job);
+                                if (k == 0) {
+                                        job->state = JOB_RUNNING;
+                                        progress = true;
+                                        continue;
+                                }
+                        }
+
+                        job->state = JOB_SKIPPED;
+                        job->result = k;
+                        job->end_usec = job->start_usec;
+                        progress = true;
+                }
+
+                for (size_t i = 0; i < n_jobs; i++) {
+                        if (jobs[i]->state >= JOB_DONE)
+                                n_finished++;
+                        else if (jobs[i]->state == JOB_RUNNING)
+                                n_running++;
+                }
+
+                if (n_finished == n_jobs)
+                        break;
+
+                /* A skipped job might unblock others. */
+                if (progress)
+                        continue;
+
+                /* Dependency on a job which is not part of the set. */
+                if (n_running == 0) {
+                        r = -EDEADLK;
+                        break;
+                }
+
+                pthread_cond_wait(&job_cond, &job_lock);
+        }
+        pthread_mutex_unlock(&job_lock);
+
+        for (size_t i = 0; i < n_jobs; i++) {
+                Job *job = jobs[i];
+
+                if (job->state == JOB_DONE)
+                        pthread_join(job->thread, NULL);
+
+                if (job->state >= JOB_DONE)
+                        job_log(job, start_usec);
+
+                if (r == 0 && job->result < 0)
+                        r = job->result;
+        }
+
+        return r;
+}
@@ -0,0 +1,40 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <pthread.h>
+
+#define JOB_AFTER_MAX 4
+
+typedef struct Job Job;
+
+struct Job {
+        const char *name;
+        int (*func)(void *userdata);
+        void *userdata;
+        Job *after[JOB_AFTER_MAX];      /* Jobs which need to finish before this one starts. */
+
+        /* Filled in by jobs_run(). */
+        pthread_t thread;
+        int state;
+        int result;
+        uint64_t start_usec;
+        uint64_t end_usec;
+        Job *blocked_by;                /* The dependency which finished last. */
+};
+
+int jobs_run(Job **jobs, size_t n_jobs);
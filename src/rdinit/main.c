@@ -21,7 +21,6 @@
 #include <string.h>
 #include <signal.h>
 #include <ctype.h>
-#include <libkmod.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
@@ -29,6 +28,7 @@
 #include <sys/reboot.h>
 #include <sys/stat.h>
 #include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 //FIXME: use bus
 #include "../devices/sysfs.h"
@@ -40,9 +40,12 @@
 #include "shared/kernel-cmdline.h"
 #include "shared/process.h"
 #include "shared/tmpfs-root.h"
+#include "shared/trace.h"
 #include "shared/uuid.h"
 #include "dev.h"
 #include "disk-gpt.h"
+#include "job.h"
+#include "modules.h"
 #include "sysctl.h"
 
 typedef struct {
@@ -51,18 +54,24 @@ typedef struct {
         struct epoll_event ep_signal;
 
         uint8_t disk_uuid[16];   /* Boot disk GPT UUID. */
+        char *disk_hint;         /* Boot disk device of the last boot. */
+        char *device_disk;       /* Boot disk device. */
         char *device_data;       /* Data device mounted at /var. */
         char *device_boot;       /* Boot device mounted at /boot. */
         char *loader_dir;        /* Boot loader directory in /boot. */
+        char *release;           /* Release name of the system image. */
 
         /* org.bus1.activator */
         pid_t activator_pid;
 } Manager;
 
 static Manager *manager_free(Manager *m) {
+        free(m->disk_hint);
+        free(m->device_disk);
         free(m->device_data);
         free(m->device_boot);
         free(m->loader_dir);
+        free(m->release);
         c_close(m->fd_ep);
         c_close(m->fd_signal);
         free(m);
@@ -175,75 +184,82 @@ static int kernel_filesystem_mount(void) {
         return 0;
 }
 
-static void module_log(void *data, int priority, const char *file, int line, const char *fn, const char *format, va_list args) {}
+struct disks {
+        char **devices;
+        size_t n_devices;
+};
 
-static int modules_load(void) {
-        static const struct module {
-                const char *name;
-                const char *path;
-        } modules[] = {
-                { "bus1",   "/sys/module/bus1" },
-                { "dm_mod", "/sys/module/dm_mod" },
-                { "loop",   "/sys/module/loop" },
-        };
-        struct kmod_ctx *ctx = NULL;
-        int r = 0;
-
-        for (size_t i = 0; i < C_ARRAY_SIZE(modules); i++) {
-                struct kmod_module *mod;
+static int sysfs_cb(const char *devpath, const char *subsystem,
+                    const char *devtype, const char *devname,
+                    const char *modalias, void *userdata) {
+        struct disks *disks = userdata;
+        char **devices;
 
-                if (modules[i].path && access(modules[i].path, F_OK) >= 0)
-                        continue;
+        if (strcmp(subsystem, "block") != 0)
+                return 0;
 
-                if (!ctx) {
-                        ctx = kmod_new(NULL, NULL);
-                        if (!ctx) {
-                                r = -ENOMEM;
-                                break;
-                        }
+        if (strcmp(devtype, "disk") != 0)
+                return 0;
 
-                        kmod_set_log_fn(ctx, module_log, NULL);
-                        r = kmod_load_resources(ctx);
-                        if (r < 0)
-                                break;
-                }
+        devices = realloc(disks->devices, (disks->n_devices + 1) * sizeof(char *));
+        if (!devices)
+                return -ENOMEM;
 
-                r = kmod_module_new_from_name(ctx, modules[i].name, &mod);
-                if (r < 0)
-                        break;
+        disks->devices = devices;
+        if (asprintf(&disks->devices[disks->n_devices], "/dev/%s", devname) < 0)
+                return -ENOMEM;
 
-                r = kmod_module_probe_insert_module(mod, KMOD_PROBE_APPLY_BLACKLIST|KMOD_PROBE_IGNORE_COMMAND,
-                                                    NULL, NULL, NULL, NULL);
-                kmod_module_unref(mod);
-                if (r < 0)
-                        break;
-        }
+        disks->n_devices++;
 
-        kmod_unref(ctx);
-        return r;
+        return 0;
 }
 
-static int sysfs_cb(const char *devpath, const char *subsystem,
-                    const char *devtype, const char *devname,
-                    const char *modalias, void *userdata) {
-        _c_cleanup_(c_freep) char *device = NULL;
-        Manager *m = userdata;
+/* Returns 1 if the disk was found, 0 if it needs to be retried. It is
+ * polled, only the probe which found the disk is traced. */
+static int manager_find_disk(Manager *m, int sysfd) {
+        struct disks disks = {};
+        uint64_t begin_usec;
         int r;
 
-        if (strcmp(subsystem, "block") != 0)
-                return 0;
+        /* The common case; the disk did not change since the last boot. */
+        if (m->disk_hint) {
+                begin_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+                r = disk_gpt_find_partitions(m->disk_hint, m->disk_uuid, &m->device_boot, &m->device_data);
+                if (r >= 0) {
+                        trace_record("gpt-probe-hint", begin_usec);
 
-        if (strcmp(devtype, "disk") != 0)
-                return 0;
+                        m->device_disk = strdup(m->disk_hint);
+                        if (!m->device_disk)
+                                return -ENOMEM;
 
-        if (asprintf(&device, "/dev/%s", devname) < 0)
-                return -ENOMEM;
+                        return 1;
+                }
+        }
 
-        r = disk_gpt_find_partitions(device, m->disk_uuid, &m->device_boot, &m->device_data);
+        /* Collect all disks and probe them concurrently. */
+        r = sysfs_enumerate(sysfd, sysfs_cb, &disks);
         if (r < 0)
-                return 0;
+                goto finish;
 
-        return 1;
+        begin_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+        r = disk_gpt_find_disk(disks.devices, disks.n_devices, m->disk_uuid, &m->device_boot, &m->device_data);
+        if (r < 0) {
+                r = 0;
+                goto finish;
+        }
+
+        trace_record("gpt-probe", begin_usec);
+
+        m->device_disk = disks.devices[r];
+        disks.devices[r] = NULL;
+        r = 1;
+
+finish:
+        for (size_t i = 0; i < disks.n_devices; i++)
+                free(disks.devices[i]);
+        free(disks.devices);
+
+        return r;
 }
 
 static int manager_run(Manager *m) {
@@ -313,7 +329,7 @@ static int manager_run(Manager *m) {
                 if (m->device_boot)
                         r = access(m->device_boot, R_OK) == 0 && access(m->device_data, R_OK) == 0;
                 else
-                        r = sysfs_enumerate(sysfd, sysfs_cb, m);
+                        r = manager_find_disk(m, sysfd);
                 if (r < 0)
                         return r;
                 if (r == 1)
@@ -454,55 +470,206 @@ static int mount_usr(const char *image, const char *dir) {
         return 0;
 }
 
+/* The boot loader passes the hint as disk.hint= to the next boot. */
+static int manager_write_disk_hint(Manager *m) {
+        _c_cleanup_(c_freep) char *file = NULL;
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+
+        if (asprintf(&file, "/tmp/boot%s/disk.hint", m->loader_dir ?: "") < 0)
+                return -ENOMEM;
+
+        f = fopen(file, "we");
+        if (!f)
+                return -errno;
+
+        fprintf(f, "%s\n", m->device_disk);
+        if (fflush(f) != 0)
+                return -errno;
+
+        return 0;
+}
+
+static int job_mount_boot(void *userdata) {
+        Manager *m = userdata;
+        int span;
+        int r;
+
+        if (mkdir("/tmp/boot", 0755) < 0)
+                return -errno;
+
+        kmsg(LOG_INFO, "Mounting boot device %s at /boot.", m->device_boot);
+        span = trace_begin("mount-boot");
+        r = mount_boot(m->device_boot, "/tmp/boot", 0);
+        trace_end(span);
+        if (r < 0)
+                return r;
+
+        if (m->device_disk && (!m->disk_hint || strcmp(m->device_disk, m->disk_hint) != 0)) {
+                r = manager_write_disk_hint(m);
+                if (r < 0)
+                        kmsg(LOG_WARNING, "Unable to store boot disk hint: %s.", strerror(-r));
+        }
+
+        return 0;
+}
+
+static int job_mount_usr(void *userdata) {
+        Manager *m = userdata;
+        _c_cleanup_(c_freep) char *image = NULL;
+        int span;
+        int r;
+
+        if (asprintf(&image, "/tmp/boot%s/%s.img", m->loader_dir ?: "", m->release) < 0)
+                return -ENOMEM;
+
+        kmsg(LOG_INFO, "Setting up integrity validation of system image %s.img.", m->release);
+        span = trace_begin("mount-usr");
+        r = mount_usr(image, "/tmp/usr");
+        trace_end(span);
+        if (r < 0) {
+                kmsg(LOG_EMERG, "Unable to mount system image %s: %s.", image, strerror(-r));
+                return r;
+        }
+
+        if (mount("/tmp/usr/etc", "/tmp/etc", NULL, MS_BIND, NULL) < 0)
+                return -errno;
+
+        r = modules_index_prefetch("/tmp/usr");
+        if (r < 0)
+                kmsg(LOG_WARNING, "Unable to prefetch the module index: %s.", strerror(-r));
+
+        return 0;
+}
+
+static int job_mount_data(void *userdata) {
+        Manager *m = userdata;
+        int span;
+        int r;
+
+        kmsg(LOG_INFO, "Setting up decryption of data volume %s.", m->device_data);
+        span = trace_begin("mount-data");
+        r = mount_data(m->device_data, "/tmp/var");
+        trace_end(span);
+        if (r < 0)
+                return r;
+
+        if (symlink("../run", "/tmp/var/run") < 0 && errno != EEXIST)
+                return -errno;
+
+        return 0;
+}
+
+/* The system image lives on the boot partition, the data volume is
+ * independent of both; unlock and mount it while /usr is verified. */
+static int manager_mount_filesystems(Manager *m) {
+        Job boot = {
+                .name = "boot",
+                .func = job_mount_boot,
+                .userdata = m,
+        };
+        Job usr = {
+                .name = "usr",
+                .func = job_mount_usr,
+                .userdata = m,
+                .after = { &boot },
+        };
+        Job data = {
+                .name = "data",
+                .func = job_mount_data,
+                .userdata = m,
+        };
+        Job *jobs[] = {
+                &boot,
+                &usr,
+                &data,
+        };
+
+        return jobs_run(jobs, C_ARRAY_SIZE(jobs));
+}
+
+#define DIRECTORY_BUFFER_SIZE (64 * 1024)
+
 static int directory_delete(int *dfd) {
-        _c_cleanup_(c_closedirp) DIR *dir = NULL;
+        _c_cleanup_(c_closep) int fd = *dfd;
+        _c_cleanup_(c_freep) uint8_t *buf = NULL;
         struct stat st;
         int r;
 
-        dir = fdopendir(*dfd);
-        if (!dir)
-                return -errno;
         *dfd = -1;
 
-        if (fstat(dirfd(dir), &st) < 0)
+        if (fstat(fd, &st) < 0)
                 return -errno;
 
-        for (struct dirent *d = readdir(dir); d; d = readdir(dir)) {
-                if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
-                        continue;
+        /* Read as many entries as possible with a single call. */
+        buf = malloc(DIRECTORY_BUFFER_SIZE);
+        if (!buf)
+                return -ENOMEM;
 
-                if (d->d_type == DT_DIR) {
-                        struct stat st2;
-                        _c_cleanup_(c_closep) int dfd2 = -1;
+        for (;;) {
+                ssize_t n;
 
-                        if (fstatat(dirfd(dir), d->d_name, &st2, AT_SYMLINK_NOFOLLOW) < 0)
-                                continue;
+                n = syscall(__NR_getdents64, fd, buf, DIRECTORY_BUFFER_SIZE);
+                if (n < 0)
+                        return -errno;
+
+                if (n == 0)
+                        break;
+
+                for (ssize_t pos = 0; pos < n;) {
+                        struct dirent64 *d = (struct dirent64 *)(buf + pos);
+                        unsigned char type = d->d_type;
+
+                        pos += d->d_reclen;
 
-                        if (st.st_dev != st2.st_dev)
+                        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
                                 continue;
 
-                        dfd2 = openat(dirfd(dir), d->d_name, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_CLOEXEC);
-                        if (dfd2 < 0)
-                                return -errno;
+                        /* The initramfs provides d_type, other file systems might not. */
+                        if (type == DT_UNKNOWN) {
+                                struct stat st2;
 
-                        r = directory_delete(&dfd2);
-                        if (r < 0)
-                                return r;
+                                if (fstatat(fd, d->d_name, &st2, AT_SYMLINK_NOFOLLOW) < 0)
+                                        continue;
 
-                        if (unlinkat(dirfd(dir), d->d_name, AT_REMOVEDIR) < 0)
-                                return -errno;
+                                if (S_ISDIR(st2.st_mode))
+                                        type = DT_DIR;
+                        }
 
-                        continue;
-                }
+                        if (type == DT_DIR) {
+                                struct stat st2;
+                                _c_cleanup_(c_closep) int dfd2 = -1;
 
-                if (unlinkat(dirfd(dir), d->d_name, 0) < 0)
-                        return -errno;
+                                dfd2 = openat(fd, d->d_name, O_RDONLY|O_NONBLOCK|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+                                if (dfd2 < 0)
+                                        return -errno;
+
+                                if (fstat(dfd2, &st2) < 0)
+                                        return -errno;
+
+                                if (st.st_dev != st2.st_dev)
+                                        continue;
+
+                                r = directory_delete(&dfd2);
+                                if (r < 0)
+                                        return r;
+
+                                if (unlinkat(fd, d->d_name, AT_REMOVEDIR) < 0)
+                                        return -errno;
+
+                                continue;
+                        }
+
+                        if (unlinkat(fd, d->d_name, 0) < 0)
+                                return -errno;
+                }
         }
 
         return 0;
 }
 
-static int switch_root(const char *newroot) {
+/* With async set, the old root is deleted by a child process which runs
+ * concurrently with the new init. */
+static int switch_root(const char *newroot, bool async) {
         static const char *mounts[] = {
                 "/dev",
                 "/proc",
@@ -537,6 +704,24 @@ static int switch_root(const char *newroot) {
         if (chdir("/") < 0)
                 return -errno;
 
+        if (async) {
+                pid_t p;
+
+                p = fork();
+                if (p < 0)
+                        return -errno;
+
+                if (p == 0) {
+                        r = directory_delete(&rootfd);
+                        if (r < 0)
+                                kmsg(LOG_WARNING, "Unable to delete the initramfs: %s.", strerror(-r));
+
+                        _exit(r < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+                }
+
+                return 0;
+        }
+
         r = directory_delete(&rootfd);
         if (r < 0)
                 return r;
@@ -631,6 +816,13 @@ static int manager_parse_kernel_cmdline(Manager *m) {
                 if (r < 0)
                         return r;
 
+                r = kernel_cmdline_option("disk.hint", &m->disk_hint);
+                if (r < 0)
+                        return r;
+
+                if (m->disk_hint && strncmp(m->disk_hint, "/dev/", 5) != 0)
+                        m->disk_hint = c_free(m->disk_hint);
+
                 return 0;
         }
 
@@ -690,15 +882,15 @@ int main(int argc, char **argv) {
         static char name[] = "org.bus1.rdinit";
         _c_cleanup_(c_fclosep) FILE *log = NULL;
         _c_cleanup_(manager_freep) Manager *m = NULL;
-        _c_cleanup_(c_freep) char *release = NULL;
         bool shell = false;
-        _c_cleanup_(c_freep) char *image = NULL;
         _c_cleanup_(c_freep) char *init = NULL;
+        _c_cleanup_(c_freep) char *cleanup = NULL;
         struct timezone tz = {};
         const char *init_argv[] = {
                 "/usr/bin/org.bus1.init",
                 NULL
         };
+        int span;
         int r;
 
         program_invocation_short_name = name;
@@ -734,7 +926,9 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto fail;
 
+        span = trace_begin("kernel-filesystems");
         r = kernel_filesystem_mount();
+        trace_end(span);
         if (r < 0)
                 goto fail;
 
@@ -757,17 +951,19 @@ int main(int argc, char **argv) {
                 goto fail;
         shell = !!r;
 
-        r = file_read_line("/usr/lib/org.bus1/release", &release);
+        r = file_read_line("/usr/lib/org.bus1/release", &m->release);
         if (r < 0)
                 goto fail;
 
         if (shell) {
-                r = rdshell(release);
+                r = rdshell(m->release);
                 if (r < 0)
                         goto fail;
         }
 
+        span = trace_begin("modules-load");
         r = modules_load();
+        trace_end(span);
         if (r < 0)
                 goto fail;
 
@@ -786,47 +982,18 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto fail;
 
+        span = trace_begin("device-discovery");
         r = manager_run(m);
+        trace_end(span);
         if (r < 0)
                 goto fail;
 
-        if (mkdir("/tmp/boot", 0755) < 0)
-                goto fail;
-
-        kmsg(LOG_INFO, "Mounting boot device %s at /boot.", m->device_boot);
-        r = mount_boot(m->device_boot, "/tmp/boot", 0);
+        r = manager_mount_filesystems(m);
         if (r < 0)
-                return r;
-
-        if (asprintf(&image, "/tmp/boot%s/%s.img", m->loader_dir ?: "", release) < 0) {
-                r = -ENOMEM;
                 goto fail;
-        }
-
-        kmsg(LOG_INFO, "Setting up integrity validation of system image %s.img.", release);
-        r = mount_usr(image, "/tmp/usr");
-        if (r < 0) {
-                kmsg(LOG_EMERG, "Unable to mount system image %s: %s.", image, strerror(-r));
-                goto fail;
-        }
-
-        if (mount("/tmp/usr/etc", "/tmp/etc", NULL, MS_BIND, NULL) < 0) {
-                r = -errno;
-                goto fail;
-        }
-
-        kmsg(LOG_INFO, "Setting up decryption of data volume %s.", m->device_data);
-        r = mount_data(m->device_data, "/tmp/var");
-        if (r < 0)
-                goto fail;
-
-        if (symlink("../run", "/tmp/var/run") < 0 && errno != EEXIST) {
-                r = -errno;
-                goto fail;
-        }
 
         if (shell) {
-                r = rdshell(release);
+                r = rdshell(m->release);
                 if (r < 0)
                         goto fail;
         }
@@ -839,7 +1006,13 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto fail;
 
-        r = switch_root("/tmp");
+        r = kernel_cmdline_option("rdcleanup", &cleanup);
+        if (r < 0)
+                goto fail;
+
+        span = trace_begin("switch-root");
+        r = switch_root("/tmp", cleanup && strcmp(cleanup, "async") == 0);
+        trace_end(span);
         if (r < 0)
                 goto fail;
 
@@ -851,6 +1024,11 @@ int main(int argc, char **argv) {
         if (r < 0)
                 goto fail;
 
+        /* Hand our boot phases over to init. */
+        r = trace_save(TRACE_RDINIT_FILE);
+        if (r < 0)
+                kmsg(LOG_WARNING, "Unable to write boot trace %s: %s.", TRACE_RDINIT_FILE, strerror(-r));
+
         kmsg(LOG_INFO, "Executing %s.", init ?: "org.bus1.init");
         if (init)
                 init_argv[0] = init;
@@ -863,7 +1041,7 @@ fail:
         kmsg(LOG_EMERG, "Unrecoverable failure. System rebooting: %s.", strerror(-r));
 
         if (shell)
-                rdshell(release);
+                rdshell(m ? m->release : NULL);
 
         sleep(5);
         reboot(RB_AUTOBOOT);
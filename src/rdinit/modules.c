@@ -0,0 +1,258 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <ctype.h>
+#include <libkmod.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include "shared/kmsg.h"
+#include "modules.h"
+
+#define MODULES_THREADS_MAX 4
+
+struct module {
+        char *name;
+        bool optional;          /* From the configuration file, failures are not fatal. */
+        int result;
+};
+
+struct modules {
+        struct module *modules;
+        size_t n_modules;
+        size_t next;
+};
+
+static void module_log(void *data, int priority, const char *file, int line, const char *fn, const char *format, va_list args) {}
+
+static int modules_add(struct modules *modules, const char *name, bool optional) {
+        struct module *m;
+
+        m = realloc(modules->modules, (modules->n_modules + 1) * sizeof(struct module));
+        if (!m)
+                return -ENOMEM;
+
+        modules->modules = m;
+        m = &modules->modules[modules->n_modules];
+        *m = (struct module){
+                .optional = optional,
+        };
+
+        m->name = strdup(name);
+        if (!m->name)
+                return -ENOMEM;
+
+        modules->n_modules++;
+
+        return 0;
+}
+
+static int modules_read_config(struct modules *modules, const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        _c_cleanup_(c_freep) char *line = NULL;
+        size_t size = 0;
+        int r;
+
+        f = fopen(file, "re");
+        if (!f) {
+                if (errno == ENOENT)
+                        return 0;
+
+                return -errno;
+        }
+
+        while (getline(&line, &size, f) >= 0) {
+                char *s = line;
+                size_t l;
+
+                while (isspace(*s))
+                        s++;
+
+                l = strcspn(s, "# \t\n");
+                if (l == 0)
+                        continue;
+
+                s[l] = '\0';
+                r = modules_add(modules, s, true);
+                if (r < 0)
+                        return r;
+        }
+
+        return 0;
+}
+
+static bool module_is_loaded(const char *name) {
+        char path[PATH_MAX];
+        size_t l;
+
+        l = snprintf(path, sizeof(path), "/sys/module/%s", name);
+        if (l >= sizeof(path))
+                return false;
+
+        /* The kernel uses underscores in module names. */
+        for (char *s = path + strlen("/sys/module/"); *s; s++)
+                if (*s == '-')
+                        *s = '_';
+
+        return access(path, F_OK) >= 0;
+}
+
+/* The libkmod context is not thread-safe, every worker uses its own. The
+ * index files are mapped and shared in the page cache. */
+static void *modules_thread(void *p) {
+        struct modules *modules = p;
+        struct kmod_ctx *ctx = NULL;
+
+        for (;;) {
+                struct module *module;
+                struct kmod_module *mod;
+                size_t i;
+                int r;
+
+                i = __atomic_fetch_add(&modules->next, 1, __ATOMIC_RELAXED);
+                if (i >= modules->n_modules)
+                        break;
+
+                module = &modules->modules[i];
+                if (module_is_loaded(module->name))
+                        continue;
+
+                if (!ctx) {
+                        ctx = kmod_new(NULL, NULL);
+                        if (!ctx) {
+                                module->result = -ENOMEM;
+                                continue;
+                        }
+
+                        kmod_set_log_fn(ctx, module_log, NULL);
+                        r = kmod_load_resources(ctx);
+                        if (r < 0) {
+                                module->result = r;
+                                ctx = kmod_unref(ctx);
+                                continue;
+                        }
+                }
+
+                r = kmod_module_new_from_name(ctx, module->name, &mod);
+                if (r < 0) {
+                        module->result = r;
+                        continue;
+                }
+
+                module->result = kmod_module_probe_insert_module(mod, KMOD_PROBE_APPLY_BLACKLIST|KMOD_PROBE_IGNORE_COMMAND,
+                                                                 NULL, NULL, NULL, NULL);
+                kmod_module_unref(mod);
+        }
+
+        kmod_unref(ctx);
+        return NULL;
+}
+
+/* Load the built-in and the configured modules concurrently, all of them
+ * are loaded when this returns. */
+int modules_load(void) {
+        static const char *names[] = {
+                "bus1",
+                "dm_mod",
+                "loop",
+        };
+        struct modules modules = {};
+        pthread_t threads[MODULES_THREADS_MAX];
+        size_t n_threads = 0;
+        int r = 0;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(names); i++) {
+                r = modules_add(&modules, names[i], false);
+                if (r < 0)
+                        goto finish;
+        }
+
+        r = modules_read_config(&modules, MODULES_CONFIG_FILE);
+        if (r < 0)
+                goto finish;
+
+        for (; n_threads < c_min(modules.n_modules - 1, C_ARRAY_SIZE(threads)); n_threads++)
+                if (pthread_create(&threads[n_threads], NULL, modules_thread, &modules) != 0)
+                        break;
+
+        modules_thread(&modules);
+
+        for (size_t i = 0; i < n_threads; i++)
+                pthread_join(threads[i], NULL);
+
+        for (size_t i = 0; i < modules.n_modules; i++) {
+                struct module *module = &modules.modules[i];
+
+                if (module->result >= 0)
+                        continue;
+
+                if (module->optional) {
+                        kmsg(LOG_WARNING, "Unable to load module %s: %s.", module->name, strerror(-module->result));
+                        continue;
+                }
+
+                kmsg(LOG_ERR, "Unable to load module %s: %s.", module->name, strerror(-module->result));
+                if (r == 0)
+                        r = module->result;
+        }
+
+finish:
+        for (size_t i = 0; i < modules.n_modules; i++)
+                free(modules.modules[i].name);
+        free(modules.modules);
+
+        return r;
+}
+
+/* Start reading the module index of the system image into the page cache,
+ * org.bus1.devices maps it right after the root is switched. */
+int modules_index_prefetch(const char *root) {
+        static const char *files[] = {
+                "modules.alias.bin",
+                "modules.builtin.bin",
+                "modules.dep.bin",
+                "modules.softdep",
+                "modules.symbols.bin",
+        };
+        struct utsname u;
+        _c_cleanup_(c_closep) int dfd = -1;
+        _c_cleanup_(c_freep) char *dir = NULL;
+
+        if (uname(&u) < 0)
+                return -errno;
+
+        if (asprintf(&dir, "%s/lib/modules/%s", root, u.release) < 0)
+                return -ENOMEM;
+
+        dfd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+        if (dfd < 0)
+                return -errno;
+
+        for (size_t i = 0; i < C_ARRAY_SIZE(files); i++) {
+                _c_cleanup_(c_closep) int fd = -1;
+
+                fd = openat(dfd, files[i], O_RDONLY|O_CLOEXEC);
+                if (fd < 0)
+                        continue;
+
+                /* Asynchronous readahead, it does not block. */
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        }
+
+        return 0;
+}
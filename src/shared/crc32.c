@@ -0,0 +1,74 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <string.h>
+#include "crc32.h"
+
+/* CRC-32 (IEEE 802.3, reflected) as used by GPT, computed eight bytes
+ * at a time with the slice-by-8 tables. */
+static uint32_t crc32_table[8][256];
+
+__attribute__((__constructor__))
+static void crc32_table_init(void) {
+        for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+
+                for (size_t k = 0; k < 8; k++)
+                        c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+
+                crc32_table[0][i] = c;
+        }
+
+        for (uint32_t i = 0; i < 256; i++)
+                for (size_t t = 1; t < 8; t++)
+                        crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^ crc32_table[0][crc32_table[t - 1][i] & 0xff];
+}
+
+/* Compatible with zlib's crc32(), start with a crc of 0. */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t size) {
+        const uint8_t *p = data;
+
+        crc = ~crc;
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+        while (size >= 8) {
+                uint32_t a, b;
+
+                memcpy(&a, p, sizeof(a));
+                memcpy(&b, p + 4, sizeof(b));
+                a ^= crc;
+
+                crc = crc32_table[7][a & 0xff] ^
+                      crc32_table[6][(a >> 8) & 0xff] ^
+                      crc32_table[5][(a >> 16) & 0xff] ^
+                      crc32_table[4][a >> 24] ^
+                      crc32_table[3][b & 0xff] ^
+                      crc32_table[2][(b >> 8) & 0xff] ^
+                      crc32_table[1][(b >> 16) & 0xff] ^
+                      crc32_table[0][b >> 24];
+
+                p += 8;
+                size -= 8;
+        }
+#endif
+
+        while (size-- > 0)
+                crc = (crc >> 8) ^ crc32_table[0][(crc ^ *p++) & 0xff];
+
+        return ~crc;
+}
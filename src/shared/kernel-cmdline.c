@@ -34,18 +34,20 @@ int kernel_cmdline_option(const char *key, char **value) {
         if (fgets(line, sizeof(line), f) == NULL)
                 return -errno;
 
-        s = strstr(line, key);
-        if (!s)
-                return false;
+        /* Skip matches inside of other options, like "disk" in "disk.hint". */
+        l = strlen(key);
+        for (s = strstr(line, key); s; s = strstr(s + 1, key)) {
+                if (s > line && s[-1] != ' ')
+                        continue;
 
-        if (s > line && s[-1] != ' ')
-                return false;
+                if (s[l] == ' ' || s[l] == '\n')
+                        return true;
 
-        l = strlen(key);
-        if (s[l] == ' ' || s[l] == '\n')
-                return true;
+                if (s[l] == '=')
+                        break;
+        }
 
-        if (s[l] != '=')
+        if (!s)
                 return false;
 
         s = s + l + 1;
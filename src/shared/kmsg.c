@@ -42,16 +42,20 @@ FILE *kmsg(int level, const char *msg, ...) {
         if (len < 1)
                 return f;
 
-        if (fprintf(f, "<%d>%s[%d]: ", LOG_USER | level, program_invocation_short_name, getpid()) < 0)
-                return f;
+        /* Keep lines from different threads in one record. */
+        flockfile(f);
+
+        if (fprintf(f, "<%d>%s[%d]: ", LOG_USER | level, program_invocation_short_name, getpid()) >= 0) {
+                va_start(ap, msg);
+                vfprintf(f, msg, ap);
+                va_end(ap);
 
-        va_start(ap, msg);
-        vfprintf(f, msg, ap);
-        va_end(ap);
+                if (msg[len - 1] != '\n')
+                        fprintf(f, "\n");
+                fflush(f);
+        }
 
-        if (msg[len - 1] != '\n')
-                fprintf(f, "\n");
-        fflush(f);
+        funlockfile(f);
 
         return f;
 }
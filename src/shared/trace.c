@@ -0,0 +1,187 @@
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+#include <c-macro.h>
+#include <c-usec.h>
+#include <string.h>
+#include "trace.h"
+
+#define TRACE_SPANS_MAX 256
+
+struct trace_span {
+        char name[32];
+        char program[16];
+        uint64_t begin_usec;
+        uint64_t end_usec;
+};
+
+struct trace_file_header {
+        char signature[8];
+        uint32_t span_size;
+        uint32_t n_spans;
+};
+
+/* Preallocated ring, the oldest spans are overwritten. */
+static struct trace_span spans[TRACE_SPANS_MAX];
+static unsigned int n_spans;
+
+static struct trace_span *trace_add(unsigned int *np) {
+        unsigned int n;
+
+        n = __atomic_fetch_add(&n_spans, 1, __ATOMIC_RELAXED);
+        if (np)
+                *np = n;
+
+        return &spans[n % TRACE_SPANS_MAX];
+}
+
+/* Returns a handle for trace_end(), it is cheap enough to be left enabled. */
+int trace_begin(const char *name) {
+        struct trace_span *span;
+        unsigned int n;
+
+        span = trace_add(&n);
+        strncpy(span->name, name, sizeof(span->name) - 1);
+        strncpy(span->program, program_invocation_short_name, sizeof(span->program) - 1);
+        span->end_usec = 0;
+        span->begin_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+
+        return n;
+}
+
+void trace_end(int span) {
+        /* The span was overwritten already. */
+        if (span < 0 || n_spans - span > TRACE_SPANS_MAX)
+                return;
+
+        spans[span % TRACE_SPANS_MAX].end_usec = c_usec_from_clock(CLOCK_BOOTTIME);
+}
+
+/* Record a span which ends now, for operations which are retried and
+ * are only worth tracing once they succeeded. */
+void trace_record(const char *name, uint64_t begin_usec) {
+        int span;
+
+        span = trace_begin(name);
+        spans[span % TRACE_SPANS_MAX].begin_usec = begin_usec;
+        trace_end(span);
+}
+
+static unsigned int trace_first(void) {
+        return n_spans > TRACE_SPANS_MAX ? n_spans - TRACE_SPANS_MAX : 0;
+}
+
+int trace_save(const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        struct trace_file_header header = {
+                .signature = "B1TRACE",
+                .span_size = sizeof(struct trace_span),
+        };
+
+        f = fopen(file, "we");
+        if (!f)
+                return -errno;
+
+        header.n_spans = n_spans - trace_first();
+        if (fwrite(&header, sizeof(header), 1, f) != 1)
+                return -EIO;
+
+        for (unsigned int i = trace_first(); i < n_spans; i++)
+                if (fwrite(&spans[i % TRACE_SPANS_MAX], sizeof(struct trace_span), 1, f) != 1)
+                        return -EIO;
+
+        if (fflush(f) != 0)
+                return -errno;
+
+        return 0;
+}
+
+/* Import the spans of an earlier boot stage into the ring. */
+int trace_load(const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        struct trace_file_header header;
+
+        f = fopen(file, "re");
+        if (!f)
+                return -errno;
+
+        if (fread(&header, sizeof(header), 1, f) != 1)
+                return -EIO;
+
+        if (memcmp(header.signature, "B1TRACE", sizeof(header.signature)) != 0)
+                return -EINVAL;
+
+        if (header.span_size != sizeof(struct trace_span))
+                return -EINVAL;
+
+        for (unsigned int i = 0; i < header.n_spans; i++) {
+                struct trace_span span;
+
+                if (fread(&span, sizeof(span), 1, f) != 1)
+                        return -EIO;
+
+                span.name[sizeof(span.name) - 1] = '\0';
+                span.program[sizeof(span.program) - 1] = '\0';
+                *trace_add(NULL) = span;
+        }
+
+        return 0;
+}
+
+static int span_compare(const void *a, const void *b) {
+        const struct trace_span *s1 = a, *s2 = b;
+
+        if (s1->begin_usec < s2->begin_usec)
+                return -1;
+        if (s1->begin_usec > s2->begin_usec)
+                return 1;
+
+        return 0;
+}
+
+int trace_write_timeline(const char *file) {
+        _c_cleanup_(c_fclosep) FILE *f = NULL;
+        struct trace_span sorted[TRACE_SPANS_MAX];
+        size_t n = 0;
+
+        for (unsigned int i = trace_first(); i < n_spans; i++)
+                sorted[n++] = spans[i % TRACE_SPANS_MAX];
+
+        qsort(sorted, n, sizeof(struct trace_span), span_compare);
+
+        f = fopen(file, "we");
+        if (!f)
+                return -errno;
+
+        fprintf(f, "%10s %10s  %-16s %s\n", "BEGIN(ms)", "TIME(ms)", "PROGRAM", "SPAN");
+        for (size_t i = 0; i < n; i++) {
+                if (sorted[i].end_usec > 0)
+                        fprintf(f, "%10.3f %10.3f  %-16s %s\n",
+                                sorted[i].begin_usec / 1000.0,
+                                (sorted[i].end_usec - sorted[i].begin_usec) / 1000.0,
+                                sorted[i].program, sorted[i].name);
+                else
+                        fprintf(f, "%10.3f %10s  %-16s %s\n",
+                                sorted[i].begin_usec / 1000.0, "-",
+                                sorted[i].program, sorted[i].name);
+        }
+
+        if (fflush(f) != 0)
+                return -errno;
+
+        return 0;
+}
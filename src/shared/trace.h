@@ -0,0 +1,29 @@
+#pragma once
+/***
+  This file is part of bus1. See COPYING for details.
+
+  bus1 is free software; you can redistribute it and/or modify it
+  under the terms of the GNU Lesser General Public License as published by
+  the Free Software Foundation; either version 2.1 of the License, or
+  (at your option) any later version.
+
+  bus1 is distributed in the hope that it will be useful, but
+  WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public License
+  along with bus1; If not, see <http://www.gnu.org/licenses/>.
+***/
+
+/* Spans recorded by org.bus1.rdinit, imported by org.bus1.init. */
+#define TRACE_RDINIT_FILE "/run/org.bus1.rdinit.trace"
+#define TRACE_TIMELINE_FILE "/run/org.bus1.boot.timeline"
+
+int trace_begin(const char *name);
+void trace_end(int span);
+void trace_record(const char *name, uint64_t begin_usec);
+
+int trace_save(const char *file);
+int trace_load(const char *file);
+int trace_write_timeline(const char *file);